@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Update the sync branches of a repository from the bundles written by
+# extract_idf_components.sh to SYNC_BUNDLE_DIR, without reaching the server:
+# the incremental bundles are fetched in turn from the local tip of a branch,
+# and its full bundle when that tip is not among their prerequisites (a branch
+# missing locally, or a rewritten history).
+#
+# Usage: apply_bundles.sh BUNDLE_DIR [SYNC_BRANCH_NAME...]
+#
+# Runs in the repository to update, usually a bare cache, and updates its
+# refs/heads/[sync branch]. Every branch of the bundle index is updated when no
+# name is given.
+
+set -e
+
+BUNDLE_DIR=$(cd $1 && pwd)
+INDEX=${BUNDLE_DIR}/bundles.txt
+[ -f ${INDEX} ] || { echo "ERROR: no bundle index in ${BUNDLE_DIR}" >&2; exit 1; }
+
+SYNC_BRANCHES="${*:2}"
+if [ -z "${SYNC_BRANCHES}" ]; then
+    SYNC_BRANCHES=$(awk '$3 == "-" { print $1 }' ${INDEX})
+fi
+
+# Usage: fetch_bundle SYNC_BRANCH_NAME FILE
+fetch_bundle() {
+    git fetch --quiet ${BUNDLE_DIR}/$2 "+refs/heads/$1:refs/heads/$1"
+}
+
+for SYNC in ${SYNC_BRANCHES}
+do
+    LATEST=$(awk -v sync="${SYNC}" '$1 == sync && $3 == "-" { print $2 }' ${INDEX})
+    [ -n "${LATEST}" ] || { echo "ERROR: no bundle of ${SYNC}" >&2; exit 1; }
+
+    LOCAL=$(git rev-parse --quiet --verify refs/heads/${SYNC} || true)
+    APPLIED=0
+    while [ -n "${LOCAL}" ] && [ "${LOCAL}" != "${LATEST}" ]
+    do
+        FILE=$(awk -v sync="${SYNC}" -v tip="${LOCAL}" '$1 == sync && $3 == tip { file = $4 } END { print file }' ${INDEX})
+        [ -n "${FILE}" ] || break
+        fetch_bundle ${SYNC} ${FILE}
+        LOCAL=$(git rev-parse refs/heads/${SYNC})
+        APPLIED=$((APPLIED + 1))
+    done
+
+    if [ "${LOCAL}" = "${LATEST}" ]; then
+        echo "${SYNC}: at ${LATEST:0:12}, ${APPLIED} incremental bundles applied"
+    else
+        fetch_bundle ${SYNC} $(awk -v sync="${SYNC}" '$1 == sync && $3 == "-" { print $4 }' ${INDEX})
+        echo "${SYNC}: at ${LATEST:0:12}, from its full bundle"
+    fi
+done
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+"""
+Generate a synthetic repository shaped like ESP-IDF, as a git fast-import
+stream on stdout:
+
+    gen_idf_repo.py --commits 20000 soc hal esp_wifi | git -C idf.git fast-import
+
+The history has a components/ layout with per-chip directories, unsynced
+top-level directories (docs, examples, tools), merged side branches, large
+binary libraries, and commit messages containing GitHub and espressif/esp-idf
+references like the ones rewritten by the message callback.
+
+The output only depends on the arguments, so that benchmark runs compare the
+same history.
+"""
+
+import argparse
+import random
+import sys
+
+CHIPS = ['esp32', 'esp32s2', 'esp32s3', 'esp32c2', 'esp32c3', 'esp32c6', 'esp32h2']
+
+# Components and top-level directories which are never synced
+UNSYNCED_COMPONENTS = ['esp_lcd', 'esp_http_server', 'console', 'fatfs', 'usb']
+UNSYNCED_DIRS = ['docs/en', 'examples/wifi', 'examples/bluetooth', 'tools/ci']
+
+MESSAGES = [
+    'Fix {c} build warnings',
+    '{c}: update register definitions for {chip}',
+    '{c}: add support for {chip}\n\nCloses https://github.com/espressif/esp-idf/issues/{n}',
+    'Merge branch \'feature/{c}_{n}\' into \'master\'\n\nSee merge request espressif/esp-idf!{n}',
+    '{c}: fix crash reported in github.com/espressif/esp-idf/pull/{n}',
+    'ci: fix {c} test on {chip}\n\nMerges https://github.com/espressif/esp-idf/pull/{n}',
+    '{c}: backport fix from github.com/someone/fork/issues/{n}',
+]
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rand = random.Random(args.seed)
+        self.out = sys.stdout.buffer
+        self.mark = 0
+        self.time = 1500000000
+        self.dirs = (['components/' + c for c in args.components + UNSYNCED_COMPONENTS] +
+                     UNSYNCED_DIRS)
+
+    def next_mark(self):
+        self.mark += 1
+        return self.mark
+
+    def write(self, text):
+        self.out.write(text if isinstance(text, bytes) else text.encode())
+
+    def data(self, payload):
+        self.write('data {}\n'.format(len(payload)))
+        self.write(payload)
+        self.write('\n')
+
+    def blob(self, payload):
+        mark = self.next_mark()
+        self.write('blob\nmark :{}\n'.format(mark))
+        self.data(payload)
+        return mark
+
+    def file_changes(self, index):
+        changes = []
+        for _ in range(self.rand.randint(1, 3)):
+            base = self.rand.choice(self.dirs)
+            chip = self.rand.choice(CHIPS)
+            path = '{}/{}/src_{}.c'.format(base, chip, self.rand.randint(0, 30))
+            text = '/* {} rev {} */\nint f_{}(void) {{ return {}; }}\n'.format(
+                path, index, index, self.rand.randint(0, 1 << 30))
+            changes.append((path, self.blob(text.encode())))
+
+        if index % self.args.blob_every == 0:
+            base = self.rand.choice(self.dirs)
+            chip = self.rand.choice(CHIPS)
+            path = '{}/lib/{}/lib{}.a'.format(base, chip, base.split('/')[-1])
+            payload = self.rand.getrandbits(self.args.blob_kb * 1024 * 8).to_bytes(
+                self.args.blob_kb * 1024, 'little')
+            changes.append((path, self.blob(payload)))
+
+        return changes
+
+    def commit(self, ref, index, parents, changes):
+        mark = self.next_mark()
+        self.time += self.rand.randint(60, 7200)
+        message = self.rand.choice(MESSAGES).format(
+            c=self.rand.choice(self.args.components), chip=self.rand.choice(CHIPS),
+            n=self.rand.randint(1, 12000))
+
+        self.write('commit {}\nmark :{}\n'.format(ref, mark))
+        self.write('author Dev {0} <dev{0}@example.com> {1} +0800\n'.format(index % 97, self.time))
+        self.write('committer Dev {0} <dev{0}@example.com> {1} +0800\n'.format(index % 13, self.time))
+        self.data(message.encode())
+        if parents:
+            self.write('from :{}\n'.format(parents[0]))
+        for parent in parents[1:]:
+            self.write('merge :{}\n'.format(parent))
+        for path, blob in changes:
+            self.write('M 100644 :{} {}\n'.format(blob, path))
+        self.write('\n')
+        return mark
+
+    def run(self):
+        ref = 'refs/heads/' + self.args.branch
+        self.write('feature done\n')
+        license_blob = self.blob(b'Apache License\nVersion 2.0, January 2004\n')
+        tip = self.commit(ref, 0, [], [('LICENSE', license_blob)] + self.file_changes(0))
+
+        index = 1
+        while index < self.args.commits:
+            if index % self.args.merge_every == 0:
+                # Side branch of two commits merged back into the main branch.
+                # fast-import moves the ref to whatever 'from' says.
+                side = tip
+                for _ in range(2):
+                    side = self.commit(ref, index, [side], self.file_changes(index))
+                    index += 1
+                tip = self.commit(ref, index, [tip, side], self.file_changes(index))
+            else:
+                tip = self.commit(ref, index, [tip], self.file_changes(index))
+            index += 1
+
+        self.write('done\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('components', nargs='+', help='names of the synced components')
+    parser.add_argument('--commits', type=int, default=20000)
+    parser.add_argument('--branch', default='release/v5.1')
+    parser.add_argument('--blob-kb', type=int, default=512, help='size of the binary libraries')
+    parser.add_argument('--blob-every', type=int, default=200,
+                        help='commits between two binary library updates')
+    parser.add_argument('--merge-every', type=int, default=50,
+                        help='commits between two merged side branches')
+    parser.add_argument('--seed', type=int, default=1)
+
+    Generator(parser.parse_args()).run()
+
+
+if __name__ == '__main__':
+    main()
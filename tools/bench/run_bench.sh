@@ -0,0 +1,128 @@
+#!/bin/bash
+
+# Offline benchmark of tools/extract_idf_components.sh
+#
+# Generates a synthetic IDF-like repository, then runs the sync script against
+# local bare repositories standing in for IDF_URL and ESP_HAL_3RDPARTY_URL, and
+# reports the time spent in each stage of each sync definition.
+#
+# Usage: run_bench.sh [WORK_DIR]
+#
+# BENCH_COMMITS, BENCH_BLOB_KB and BENCH_SEED shape the generated history, which
+# is kept in WORK_DIR and reused while they don't change. BENCH_KEEP_REMOTE=1
+# keeps the sync branches pushed by the previous run, to measure the steady
+# state of INCREMENTAL or SKIP_UNCHANGED. Every other variable of the sync
+# script (SYNC_JOBS, UNION_FILTER, OPTIMIZE_REMOTE...) is passed through.
+#
+# Each sync branch is then cloned from the stand-in remote, as a downstream
+# client would, to measure how fast the pushed branches are served.
+
+set -e
+
+BENCH_DIR=$(cd $(dirname $0) && pwd)
+source ${BENCH_DIR}/../sync_manifest.sh
+
+WORK_DIR=$(mkdir -p ${1:-bench_work} && cd ${1:-bench_work} && pwd)
+BENCH_COMMITS=${BENCH_COMMITS:-20000}
+BENCH_BLOB_KB=${BENCH_BLOB_KB:-512}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_KEEP_REMOTE=${BENCH_KEEP_REMOTE:-0}
+
+IDF_REPO=${WORK_DIR}/idf.git
+HAL_REPO=${WORK_DIR}/esp-hal-3rdparty.git
+TIMINGS=${WORK_DIR}/timings.tsv
+METRICS=${WORK_DIR}/metrics.jsonl
+
+# Usage: collect_definition ESP_IDF_BRANCH SYNC_BRANCH_NAME MSG_CALLBACK COMPONENTS...
+collect_definition() {
+    IDF_BRANCHES+="$1 "
+    SYNC_BRANCHES+="$2 "
+    for COMPONENT in "${@:4}"
+    do
+        # chip:[target] entries select chip directories, which every generated
+        # component has
+        if [ "${COMPONENT#chip:}" = "${COMPONENT}" ]; then
+            COMPONENTS+="${COMPONENT} "
+        fi
+    done
+}
+
+IDF_BRANCHES=""
+SYNC_BRANCHES=""
+COMPONENTS=""
+read_manifest collect_definition
+IDF_BRANCHES=$(echo ${IDF_BRANCHES} | tr ' ' '\n' | sort -u)
+COMPONENTS=$(echo ${COMPONENTS} | tr ' ' '\n' | sort -u)
+
+# Usage: generate_idf
+generate_idf() {
+    GEN_KEY="${BENCH_COMMITS} ${BENCH_BLOB_KB} ${BENCH_SEED} $(echo ${IDF_BRANCHES} ${COMPONENTS})"
+    if [ -f ${IDF_REPO}/bench-key ] && [ "$(cat ${IDF_REPO}/bench-key)" = "${GEN_KEY}" ]; then
+        echo "Reusing generated IDF repository ${IDF_REPO}"
+        return
+    fi
+
+    rm -rf ${IDF_REPO}
+    git init --quiet --bare ${IDF_REPO}
+    # Needed by PARTIAL_CLONE
+    git -C ${IDF_REPO} config uploadpack.allowFilter true
+    git -C ${IDF_REPO} config uploadpack.allowAnySHA1InWant true
+
+    for BRANCH in ${IDF_BRANCHES}
+    do
+        echo "Generating ${BENCH_COMMITS} commits on ${BRANCH}"
+        python3 ${BENCH_DIR}/gen_idf_repo.py --commits ${BENCH_COMMITS} \
+            --blob-kb ${BENCH_BLOB_KB} --seed ${BENCH_SEED} --branch ${BRANCH} ${COMPONENTS} |
+            git -C ${IDF_REPO} fast-import --quiet
+    done
+    git -C ${IDF_REPO} gc --quiet
+    echo "${GEN_KEY}" > ${IDF_REPO}/bench-key
+}
+
+generate_idf
+
+if [ "${BENCH_KEEP_REMOTE}" != "1" ] || [ ! -d ${HAL_REPO} ]; then
+    rm -rf ${HAL_REPO}
+    git init --quiet --bare ${HAL_REPO}
+fi
+
+rm -rf ${WORK_DIR}/run ${TIMINGS} ${METRICS}
+mkdir ${WORK_DIR}/run
+
+echo "Running the sync, trace in ${WORK_DIR}/sync.log"
+START=${EPOCHREALTIME}
+(
+    cd ${WORK_DIR}/run
+    # Empty CI variables, so that no debug suffix is added to the branches
+    CI_COMMIT_BRANCH="" CI_DEFAULT_BRANCH="" \
+        IDF_URL=file://${IDF_REPO} ESP_HAL_3RDPARTY_URL=${HAL_REPO} \
+        SYNC_TIMINGS=${TIMINGS} SYNC_METRICS=${METRICS} \
+        ${BENCH_DIR}/../extract_idf_components.sh
+) > ${WORK_DIR}/sync.log 2>&1 || {
+    tail -n 30 ${WORK_DIR}/sync.log
+    echo "Sync failed, see ${WORK_DIR}/sync.log"
+    exit 1
+}
+TOTAL=$(awk "BEGIN { printf \"%.3f\", ${EPOCHREALTIME} - ${START} }")
+
+echo
+printf '%-32s %-12s %10s\n' SCOPE STAGE SECONDS
+sort -s -k1,1 ${TIMINGS} | awk -F '\t' '{ printf "%-32s %-12s %10s\n", $1, $2, $3 }'
+echo
+echo "Total per stage:"
+awk -F '\t' '{ total[$2] += $3 } END { for (s in total) printf "  %-12s %10.3f\n", s, total[s] }' ${TIMINGS} |
+    sort
+echo "Wall time: ${TOTAL} s"
+echo "Stage metrics: ${METRICS}"
+
+echo
+echo "Downstream clones:"
+for SYNC in ${SYNC_BRANCHES}
+do
+    rm -rf ${WORK_DIR}/clone
+    START=${EPOCHREALTIME}
+    git clone --quiet --bare --single-branch --branch ${SYNC} file://${HAL_REPO} ${WORK_DIR}/clone
+    printf '  %-30s %8.3f s %10s bytes\n' ${SYNC} \
+        $(awk "BEGIN { print ${EPOCHREALTIME} - ${START} }") $(du -sb ${WORK_DIR}/clone/objects | cut -f1)
+done
+rm -rf ${WORK_DIR}/clone
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Check that the message rules of tools/msg_rules/ rewrite every commit message
+of a history exactly like the message callback of the same name in
+tools/msg_callbacks/, run in an IDF clone (a blobless one is enough):
+
+    check_msg_rules.py --git-dir idf.git github_links
+
+Every rules file with a callback is checked when no name is given, over the
+history of all the refs unless revisions are given with --revs. The rules are
+applied twice: as parsed by filter-repo itself (the git_filter_repo module of
+pip install git-filter-repo), which rewrites the messages of the sync, and by
+tools/filter_engine.py, which does with FILTER_ENGINE=native. The first
+differences are printed, with a non-zero exit status. The time each variant
+spent is reported, as the rules replace the callback in the filtering of
+every commit.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, TOOLS_DIR)
+
+from filter_engine import MessageRules, make_callback  # noqa: E402
+
+try:
+    from git_filter_repo import FilteringOptions
+except ImportError:
+    sys.exit('git_filter_repo is needed, see pip install git-filter-repo')
+
+
+def rules_file(name):
+    return os.path.join(TOOLS_DIR, 'msg_rules', name + '.txt')
+
+
+def callback_file(name):
+    return os.path.join(TOOLS_DIR, 'msg_callbacks', name + '.py')
+
+
+def messages(git_dir, revs):
+    """Commit IDs and raw messages of a history"""
+    git = ['git', '--git-dir', git_dir]
+    oids = subprocess.check_output(git + ['rev-list'] + revs).split()
+    reader = subprocess.Popen(git + ['cat-file', '--batch'], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    for oid in oids:
+        reader.stdin.write(oid + b'\n')
+        reader.stdin.flush()
+        size = int(reader.stdout.readline().split()[2])
+        data = reader.stdout.read(size)
+        reader.stdout.read(1)
+        yield oid, data.partition(b'\n\n')[2]
+    reader.stdin.close()
+    reader.wait()
+
+
+def filter_repo_rules(path):
+    """The rules of a file as filter-repo parses its --replace-message option,
+    applied as it does: every literal, then every regular expression"""
+    rules = FilteringOptions.parse_args(['--replace-message', path], error_on_empty=False).replace_message
+
+    def apply(message):
+        for literal, replacement in rules['literals']:
+            message = message.replace(literal, replacement)
+        for regex, replacement in rules['regexes']:
+            message = regex.sub(replacement, message)
+        return message
+
+    return apply
+
+
+def timed(function, inputs):
+    start = time.perf_counter()
+    outputs = [function(message) for message in inputs]
+    return outputs, time.perf_counter() - start
+
+
+def check(name, history, max_shown):
+    with open(callback_file(name)) as code:
+        callback = make_callback(code.read())
+    variants = [('filter-repo', filter_repo_rules(rules_file(name))),
+                ('engine', MessageRules(rules_file(name)).apply)]
+
+    inputs = [message for _, message in history]
+    expected, callback_time = timed(callback, inputs)
+    rewritten = sum(1 for before, after in zip(inputs, expected) if before != after)
+    print('{}: {} messages, {} rewritten by the callback in {:.3f} s'.format(
+        name, len(inputs), rewritten, callback_time))
+
+    identical = True
+    for variant, rewrite in variants:
+        actual, rules_time = timed(rewrite, inputs)
+        differences = [(oid, want, got) for (oid, _), want, got in zip(history, expected, actual) if want != got]
+        print('  rules by {}: {} differences in {:.3f} s'.format(variant, len(differences), rules_time))
+        for oid, want, got in differences[:max_shown]:
+            print('    {}\n      callback: {!r}\n      rules:    {!r}'.format(oid.decode(), want, got))
+        identical = identical and not differences
+    return identical
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('names', nargs='*', help='message rewrites to check, all by default')
+    parser.add_argument('--git-dir', default='.', help='repository holding the history')
+    parser.add_argument('--revs', nargs='+', default=['--all'], help='revisions of the history')
+    parser.add_argument('--max-shown', type=int, default=10, help='differences printed per rewrite')
+    args = parser.parse_args()
+
+    names = args.names or sorted(entry[:-len('.txt')] for entry in os.listdir(os.path.join(TOOLS_DIR, 'msg_rules'))
+                                 if entry.endswith('.txt') and os.path.exists(callback_file(entry[:-len('.txt')])))
+    history = list(messages(args.git_dir, args.revs))
+
+    results = [check(name, history, args.max_shown) for name in names]
+    sys.exit(0 if all(results) else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,354 @@
+#!/usr/bin/env python3
+"""
+Compute the dependency closure of the root components of a sync definition in
+an IDF clone (a blobless one is enough, the few files read are fetched), and
+compare it with the components the definition syncs:
+
+    component_deps.py --git-dir idf.git sync-1-release_v5.1
+
+The roots come from tools/component_roots.txt, the IDF branch, the chips and
+the synced components from the manifest. Every definition with roots is
+checked when no name is given. The requirements are read from the REQUIRES and
+PRIV_REQUIRES of each component's CMakeLists.txt, including the values of the
+variables set anywhere in the file (whatever the conditions, the closure is an
+upper bound), from the dependencies of its idf_component.yml, and from the
+requirements IDF adds to every component (tools/cmake/build.cmake).
+
+The report lists the synced components which are unreachable from the roots,
+the ones required but not synced, and the dependencies on components of the
+IDF component registry, which the sync can't include. With --definition, a
+manifest definition syncing only the closure is printed. It is a new sync
+branch: changing the components of an existing one changes its history.
+
+Roots and components can also be given directly, without the manifest:
+
+    component_deps.py --git-dir idf.git --rev release/v5.1 --roots esp_wifi bt \\
+        --chips esp32c3 --provided freertos --synced esp_wifi bt soc hal
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# Architecture component of each chip, as set in IDF_TARGET_ARCH
+CHIP_ARCHS = {
+    'esp32': 'xtensa', 'esp32s2': 'xtensa', 'esp32s3': 'xtensa',
+    'esp32c2': 'riscv', 'esp32c3': 'riscv', 'esp32c5': 'riscv', 'esp32c6': 'riscv',
+    'esp32h2': 'riscv', 'esp32p4': 'riscv',
+}
+
+# Keywords of idf_component_register, ending the list of the previous one
+REGISTER_KEYWORDS = {
+    'SRCS', 'SRC_DIRS', 'EXCLUDE_SRCS', 'INCLUDE_DIRS', 'PRIV_INCLUDE_DIRS', 'LDFRAGMENTS',
+    'REQUIRES', 'PRIV_REQUIRES', 'REQUIRED_IDF_TARGETS', 'EMBED_FILES', 'EMBED_TXTFILES',
+    'KCONFIG', 'KCONFIG_PROJBUILD', 'WHOLE_ARCHIVE',
+}
+
+# Keywords of set(), not values
+SET_KEYWORDS = {'PARENT_SCOPE', 'CACHE', 'BOOL', 'FILEPATH', 'PATH', 'STRING', 'INTERNAL', 'FORCE'}
+
+# Variables of the legacy register_component()
+LEGACY_REQUIRES = ('COMPONENT_REQUIRES', 'COMPONENT_PRIV_REQUIRES')
+
+BUILD_CMAKE = 'tools/cmake/build.cmake'
+COMMAND = re.compile(r'([A-Za-z_][A-Za-z0-9_]*)\s*\(')
+VARIABLE = re.compile(r'^\$\{([A-Za-z0-9_]+)\}$')
+NAME = re.compile(r'^[A-Za-z0-9_\-]+$')
+
+
+def git(git_dir, *args, **kwargs):
+    return subprocess.check_output(['git', '--git-dir', git_dir] + list(args), **kwargs)
+
+
+def read_files(git_dir, rev, patterns):
+    """Content of the files of a revision matching sparse-checkout patterns, by
+    path, fetching first the blobs missing from a partial clone in one go"""
+    spec = git(git_dir, 'hash-object', '-w', '--stdin', input='\n'.join(patterns).encode()).decode().strip()
+    missing = [line[1:] for line in git(git_dir, 'rev-list', '--no-walk', '--objects', '--missing=print',
+                                        '--filter=sparse:oid=' + spec, rev).decode().splitlines()
+               if line.startswith('?')]
+    if missing:
+        print('Fetching {} blobs'.format(len(missing)), file=sys.stderr)
+        git(git_dir, '-c', 'fetch.negotiationAlgorithm=noop', 'fetch', 'origin', '--no-tags',
+            '--no-write-fetch-head', '--recurse-submodules=no', '--filter=blob:none', '--stdin',
+            input='\n'.join(missing).encode())
+
+    # The paths come from the trees, rev-list only prints the first one of a blob
+    matches = re.compile('|'.join(re.escape(pattern.lstrip('/')).replace(r'\*', '[^/]*') for pattern in patterns))
+    blobs = {}
+    for entry in git(git_dir, 'ls-tree', '-r', rev, '--', *{pattern.lstrip('/').split('/')[0] for pattern in patterns}
+                     ).decode().splitlines():
+        info, path = entry.split('\t', 1)
+        if info.split()[1] == 'blob' and matches.fullmatch(path):
+            blobs.setdefault(info.split()[2], []).append(path)
+
+    files = {}
+    reader = subprocess.Popen(['git', '--git-dir', git_dir, 'cat-file', '--batch'],
+                              stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    for oid, paths in blobs.items():
+        reader.stdin.write(oid.encode() + b'\n')
+        reader.stdin.flush()
+        size = int(reader.stdout.readline().split()[2])
+        text = reader.stdout.read(size).decode(errors='replace')
+        reader.stdout.read(1)
+        files.update((path, text) for path in paths)
+    reader.stdin.close()
+    reader.wait()
+    return files
+
+
+def cmake_commands(text):
+    """(name, arguments) of the commands of a CMake file, the quoted lists split"""
+    text = re.sub(r'#[^\n]*', '', text)
+    position = 0
+    while True:
+        match = COMMAND.search(text, position)
+        if not match:
+            return
+        depth, end = 1, match.end()
+        while end < len(text) and depth:
+            depth += {'(': 1, ')': -1}.get(text[end], 0)
+            end += 1
+        arguments = []
+        for argument in text[match.end():end - 1].split():
+            arguments.extend(value for value in argument.strip('"').split(';') if value)
+        yield match.group(1), arguments
+        position = end
+
+
+class CMakeFile:
+    """Values of the variables of a CMake file, and the requirement lists of its
+    component registrations"""
+
+    def __init__(self, text, archs):
+        self.variables = {}
+        self.requires = []
+        self.common_requires = []
+        for name, arguments in cmake_commands(text):
+            name = name.lower()
+            if name == 'set' and arguments:
+                self.variables.setdefault(arguments[0], []).extend(
+                    value for value in arguments[1:] if value not in SET_KEYWORDS)
+            elif name == 'list' and len(arguments) > 1 and arguments[0] in ('APPEND', 'PREPEND', 'INSERT'):
+                self.variables.setdefault(arguments[1], []).extend(arguments[2:])
+            elif name == 'idf_build_get_property' and len(arguments) > 1:
+                if arguments[1] == 'IDF_TARGET_ARCH':
+                    self.variables[arguments[0]] = sorted(archs)
+            elif name == 'idf_build_set_property' and arguments[:1] == ['__COMPONENT_REQUIRES_COMMON']:
+                self.common_requires.extend(value for value in arguments[1:] if value != 'APPEND')
+            elif name == 'idf_component_register':
+                keyword = None
+                for argument in arguments:
+                    if argument in REGISTER_KEYWORDS:
+                        keyword = argument
+                    elif keyword in ('REQUIRES', 'PRIV_REQUIRES'):
+                        self.requires.append(argument)
+        for variable in LEGACY_REQUIRES:
+            self.requires.extend(self.variables.get(variable, []))
+        self.variables.setdefault('IDF_TARGET_ARCH', sorted(archs))
+
+    def expand(self, values, seen=()):
+        """Component names of a list of values, with its variables expanded"""
+        names = []
+        for value in values:
+            match = VARIABLE.match(value)
+            if match and match.group(1) not in seen:
+                names.extend(self.expand(self.variables.get(match.group(1), []), seen + (match.group(1),)))
+            elif NAME.match(value):
+                names.append(value)
+        return names
+
+
+def manifest_dependencies(text):
+    """Dependency names of an idf_component.yml, without the IDF version one"""
+    names = []
+    indent = None
+    in_dependencies = False
+    for line in text.splitlines():
+        if not line.strip() or line.lstrip().startswith('#'):
+            continue
+        depth = len(line) - len(line.lstrip())
+        if depth == 0:
+            in_dependencies = line.startswith('dependencies:')
+            indent = None
+            continue
+        if not in_dependencies:
+            continue
+        indent = depth if indent is None else indent
+        key = line.strip().partition(':')[0].strip('\'"')
+        if depth == indent and key != 'idf':
+            names.append(key)
+    return names
+
+
+class Components:
+    """Requirements of the components of an IDF revision"""
+
+    def __init__(self, git_dir, rev, chips):
+        archs = {CHIP_ARCHS[chip] for chip in chips}
+        files = read_files(git_dir, rev, ['/components/*/CMakeLists.txt', '/components/*/idf_component.yml',
+                                          '/' + BUILD_CMAKE])
+        self.names = set(git(git_dir, 'ls-tree', '--name-only', rev + ':components').decode().split())
+        self.requires = {name: set() for name in self.names}
+        for path, text in files.items():
+            parts = path.split('/')
+            if len(parts) != 3 or parts[1] not in self.requires:
+                continue
+            if parts[2] == 'CMakeLists.txt':
+                cmake = CMakeFile(text, archs)
+                self.requires[parts[1]].update(cmake.expand(cmake.requires))
+            else:
+                self.requires[parts[1]].update(manifest_dependencies(text))
+
+        self.common = set()
+        if BUILD_CMAKE in files:
+            cmake = CMakeFile(files[BUILD_CMAKE], archs)
+            self.common = set(cmake.expand(cmake.common_requires))
+        if not self.common:
+            print('No common requirements found in {}'.format(BUILD_CMAKE), file=sys.stderr)
+
+    def closure(self, roots, provided):
+        """Local components reachable from the roots, with the component each one
+        was first required by, and the other requirements found on the way"""
+        reached = {root: None for root in roots if root in self.names}
+        unknown = {root: None for root in roots if root not in self.names}
+        pending = list(roots)
+        while pending:
+            name = pending.pop()
+            if name in provided or name not in self.names:
+                continue
+            for required in sorted((self.requires[name] | self.common) - {name}):
+                if required in reached or required in unknown:
+                    continue
+                if required in self.names:
+                    reached[required] = name
+                    pending.append(required)
+                else:
+                    unknown[required] = name
+        return reached, unknown
+
+
+def branch_rev(git_dir, branch):
+    """Revision of an IDF branch, local in the clones of the sync script, or
+    else a remote-tracking one"""
+    for rev in ('refs/heads/' + branch, 'refs/remotes/origin/' + branch):
+        if subprocess.call(['git', '--git-dir', git_dir, 'rev-parse', '--quiet', '--verify', rev],
+                           stdout=subprocess.DEVNULL) == 0:
+            return rev
+    return branch
+
+
+def manifest_definitions():
+    """(IDF branch, message rewrite, components) of the manifest definitions, by
+    sync branch name"""
+    output = subprocess.check_output(
+        ['bash', '-c', 'source "$0/sync_manifest.sh"; print_def() { echo "$@"; }; read_manifest print_def',
+         TOOLS_DIR], text=True)
+    definitions = {}
+    for line in output.splitlines():
+        idf_branch, sync_branch, msg_callback, *components = line.split()
+        definitions[sync_branch] = (idf_branch, msg_callback, components)
+    return definitions
+
+
+def read_roots(path):
+    """Root entries by sync branch name, from the lines of a roots file"""
+    roots = {}
+    with open(path) as lines:
+        text = re.sub(r'\\\n', ' ', lines.read())
+    for line in text.splitlines():
+        fields = line.split()
+        if fields and not fields[0].startswith('#'):
+            roots[fields[0]] = fields[1:]
+    return roots
+
+
+def report(title, components, roots, provided, synced):
+    reached, unknown = components.closure(roots, provided)
+    needed = {name for name in reached if name not in provided}
+    print('{}: {} synced components, {} in the closure of {}'.format(
+        title, len(synced), len(needed), ' '.join(roots)))
+
+    def required_by(names, origins):
+        return ' '.join('{} ({})'.format(name, origins[name]) if origins[name] else name for name in sorted(names))
+
+    unreachable = sorted(set(synced) - needed)
+    missing = needed - set(synced)
+    if unreachable:
+        print('  unreachable: ' + ' '.join(unreachable))
+    if missing:
+        print('  missing:     ' + required_by(missing, reached))
+    registry = {name for name in unknown if '/' in name}
+    if registry:
+        print('  registry:    ' + required_by(registry, unknown))
+    if set(unknown) - registry:
+        print('  unknown:     ' + required_by(set(unknown) - registry, unknown))
+    return sorted(needed), bool(unreachable or missing)
+
+
+def print_definition(idf_branch, sync_branch, msg_callback, entries):
+    indent = ' ' * (len(idf_branch) + 2)
+    lines = ['{}  {}  {}'.format(idf_branch, sync_branch, msg_callback)] + [indent + entry for entry in entries]
+    print(' \\\n'.join(lines))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('names', nargs='*', help='sync branch names, all the ones with roots by default')
+    parser.add_argument('--git-dir', default='.', help='IDF repository')
+    parser.add_argument('--rev', help='IDF revision, the branch of each definition by default')
+    parser.add_argument('--roots-file', default=os.path.join(TOOLS_DIR, 'component_roots.txt'),
+                        help='roots of the sync definitions')
+    parser.add_argument('--roots', nargs='+', help='root components, instead of a sync definition')
+    parser.add_argument('--chips', nargs='+', default=sorted(CHIP_ARCHS), help='chips of --roots')
+    parser.add_argument('--provided', nargs='+', default=[], help='components of --roots provided by the consumers')
+    parser.add_argument('--synced', nargs='+', default=[], help='components synced with --roots')
+    parser.add_argument('--msg-callback', default='github_links', help='message rewrite of the --roots definition')
+    parser.add_argument('--definition', metavar='SYNC_BRANCH_NAME',
+                        help='print a manifest definition of the closure, named SYNC_BRANCH_NAME')
+    parser.add_argument('--strict', action='store_true',
+                        help='exit with an error when a synced component is unreachable or a needed one missing')
+    args = parser.parse_args()
+
+    if args.roots:
+        if args.definition and not args.rev:
+            parser.error('--definition needs the IDF branch as --rev')
+        components = Components(args.git_dir, args.rev or 'HEAD', args.chips)
+        needed, differs = report('roots', components, args.roots, set(args.provided), args.synced)
+        if args.definition:
+            print_definition(args.rev, args.definition, args.msg_callback,
+                             ['chip:' + chip for chip in args.chips if len(args.chips) < len(CHIP_ARCHS)] + needed)
+        sys.exit(1 if args.strict and differs else 0)
+
+    definitions = manifest_definitions()
+    roots = read_roots(args.roots_file)
+    names = args.names or [name for name in definitions if name in roots]
+    failed = False
+    for name in names:
+        if name not in definitions:
+            parser.error('{} is not a sync definition of the manifest'.format(name))
+        if name not in roots:
+            print('{}: no roots in {}'.format(name, args.roots_file))
+            continue
+        idf_branch, msg_callback, entries = definitions[name]
+        chips = [entry[len('chip:'):] for entry in entries if entry.startswith('chip:')] or sorted(CHIP_ARCHS)
+        synced = [entry for entry in entries if not entry.startswith('chip:')]
+        provided = {entry[len('provided:'):] for entry in roots[name] if entry.startswith('provided:')}
+
+        components = Components(args.git_dir, args.rev or branch_rev(args.git_dir, idf_branch), chips)
+        needed, differs = report(name, components, [entry for entry in roots[name] if ':' not in entry],
+                                 provided, synced)
+        failed |= differs
+        if args.definition:
+            print_definition(idf_branch, args.definition, msg_callback,
+                             ['chip:' + chip for chip in chips if len(chips) < len(CHIP_ARCHS)] + needed)
+    sys.exit(1 if args.strict and failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -2,30 +2,1001 @@
 
 set -ex
 
+source $(dirname $0)/sync_manifest.sh
+
+# Set VERIFY=1 to rebuild the sync branches locally and compare them with the
+# published ones, without pushing anything
+VERIFY=${VERIFY:-0}
+
 # If the pipeline is running from a branch different from project's default
-# add a suffix to push sync branch
-if [ "${CI_COMMIT_BRANCH}" != "${CI_DEFAULT_BRANCH}" ]; then
+# add a suffix to push sync branch. A verification compares with the real ones.
+if [ "${CI_COMMIT_BRANCH}" != "${CI_DEFAULT_BRANCH}" ] && [ "${VERIFY}" != "1" ]; then
     DEBUG_SUFFIX="-debug"
 fi
 
+# Set INCREMENTAL=1 to rewrite only the upstream commits that arrived since the
+# last sync, using the filter-repo state published next to each sync branch
+INCREMENTAL=${INCREMENTAL:-0}
+
+# Set IDF_MIRROR_DIR to a persistent directory (runner-local or CI cache) to
+# keep a bare IDF mirror that is only updated with the new upstream commits
+IDF_MIRROR_DIR=${IDF_MIRROR_DIR:-}
+
+# Set PARTIAL_CLONE=1 to clone IDF without blobs, and download in one go only the
+# blobs of the synced paths, which are the only ones filter-repo reads
+PARTIAL_CLONE=${PARTIAL_CLONE:-0}
+
+# Number of sync definitions extracted at the same time. With more than one,
+# each definition runs as a background job logging to SYNC_LOG_DIR
+SYNC_JOBS=${SYNC_JOBS:-1}
+SYNC_LOG_DIR=${SYNC_LOG_DIR:-sync_logs}
+
+# Set UNION_FILTER=1 to filter each IDF branch once with the union of the paths
+# of its sync definitions, and derive every sync branch from that history
+UNION_FILTER=${UNION_FILTER:-0}
+
+# Set SKIP_UNCHANGED=1 to skip, without cloning nor filtering, the sync
+# definitions whose paths did not change upstream since their last sync
+SKIP_UNCHANGED=${SKIP_UNCHANGED:-0}
+SYNC_CHECK_DIR=${SYNC_CHECK_DIR:-sync_check}
+
+# Range of the IDF push which triggered the run, set by tools/sync_trigger.py.
+# Only reported, every sync goes up to the current tip of its IDF branch.
+IDF_PUSH_BEFORE=${IDF_PUSH_BEFORE:-}
+IDF_PUSH_AFTER=${IDF_PUSH_AFTER:-}
+
+# Space separated sync branch names to run, instead of every definition of the
+# manifest. Used by the generated CI jobs to run one definition each.
+SYNC_ONLY=${SYNC_ONLY:-}
+
+# File receiving one "SCOPE<TAB>STAGE<TAB>SECONDS" line per stage, when set.
+# Must be an absolute path, stages run from several directories.
+SYNC_TIMINGS=${SYNC_TIMINGS:-}
+
+# File receiving one JSON object per line and stage, with its wall time, the
+# peak RSS of its processes and the commits, objects and bytes it handled.
+# Must be an absolute path too.
+SYNC_METRICS=${SYNC_METRICS:-}
+
+# Delta search window and depth of the packs pushed to ESP_HAL_3RDPARTY_URL.
+# With OPTIMIZE_REMOTE=1, ESP_HAL_3RDPARTY_URL must be a local repository, which
+# is repacked for its clients once every sync is pushed.
+PACK_WINDOW=${PACK_WINDOW:-250}
+PACK_DEPTH=${PACK_DEPTH:-50}
+OPTIMIZE_REMOTE=${OPTIMIZE_REMOTE:-0}
+
+# Space separated names of other remotes receiving the pushes, in parallel with
+# ESP_HAL_3RDPARTY_URL. For each NAME, PUSH_MIRROR_[NAME]_URL is its URL with its
+# credentials, and PUSH_MIRROR_[NAME]_REFS optionally maps the pushed refs with
+# space separated "PATTERN:DESTINATION" globs, the first matching one applying
+# (the branches keep their name by default, other refs are not pushed).
+# Every push is tried PUSH_RETRIES times.
+PUSH_MIRRORS=${PUSH_MIRRORS:-}
+PUSH_RETRIES=${PUSH_RETRIES:-3}
+PUSH_RETRY_DELAY=${PUSH_RETRY_DELAY:-10}
+
+# Set VENDOR_SUBMODULES=1 to also publish libs/[sync branch], the sync branch
+# with the content of its submodules (Wi-Fi, PHY and BT libraries) in place of
+# their gitlinks
+VENDOR_SUBMODULES=${VENDOR_SUBMODULES:-0}
+
+# Workspaces are removed as soon as their sync is pushed, and IDF clones once
+# no remaining sync needs them. KEEP_WORKSPACES=1 keeps both, for debugging.
+KEEP_WORKSPACES=${KEEP_WORKSPACES:-0}
+
+# Disk usage limit of a run in MiB, counting the working directory and the IDF
+# mirror (0 for none). A sync starts once the running ones freed enough space,
+# the run fails when it is over the limit with nothing left to wait for.
+SYNC_DISK_BUDGET=${SYNC_DISK_BUDGET:-0}
+
+# Set FILTER_ENGINE=native to make the full rewrites with tools/filter_engine.py,
+# which makes the same commits as filter-repo from the trees instead of exporting
+# every file change. FILTER_JOBS processes filter the trees, and their memo is kept
+# between runs in FILTER_CACHE_DIR when set (an absolute path). Incremental
+# rewrites, and the histories the engine can't rewrite the same way, still go
+# through filter-repo. The engine keeps no filter-repo state: after one of its
+# rewrites the published state is deleted, and the next INCREMENTAL run is a
+# full rewrite again.
+FILTER_ENGINE=${FILTER_ENGINE:-filter-repo}
+FILTER_JOBS=${FILTER_JOBS:-$(nproc)}
+FILTER_CACHE_DIR=${FILTER_CACHE_DIR:-}
+
+# Directory receiving git bundles of the pushed sync branches when set (an
+# absolute path), for the consumers which can't fetch from ESP_HAL_3RDPARTY_URL:
+# the full history of each branch, and the commits each sync added to it, listed
+# with their prerequisites in its bundles.txt. The last SYNC_BUNDLE_KEEP
+# incremental bundles of each branch are kept. See tools/apply_bundles.sh.
+SYNC_BUNDLE_DIR=${SYNC_BUNDLE_DIR:-}
+SYNC_BUNDLE_KEEP=${SYNC_BUNDLE_KEEP:-30}
+
+# Set DEPS_CHECK=1 to report, for the sync definitions with roots in
+# tools/component_roots.txt, the synced components these roots don't need and
+# the needed ones which are not synced, see tools/component_deps.py
+DEPS_CHECK=${DEPS_CHECK:-0}
+# Sparse patterns of the files it reads, prefetched with PARTIAL_CLONE=1
+DEPS_FILES=('/components/*/CMakeLists.txt' '/components/*/idf_component.yml' '/tools/cmake/build.cmake')
+
+# Local branch used by filter-repo to keep its marks between runs
+STATE_BRANCH="filter-repo-state"
+
+# Usage: die MESSAGE
+die() {
+    echo "ERROR: $*" >&2
+    exit 1
+}
+
+# Run a command as a stage, recording its duration in SYNC_TIMINGS and its
+# metrics in SYNC_METRICS. The command runs in a subshell, so it can't change
+# the state of the script. Its status is returned, so a stage can be used as a
+# condition: bash ignores set -e in the whole stage then, so the functions run
+# by such a stage have to check the status of each of their steps.
+# Usage: run_stage SCOPE STAGE COMMAND...
+run_stage() {
+    STAGE_START=${EPOCHREALTIME}
+    STAGE_METRICS_FILE=""
+    if [ -n "${SYNC_METRICS}" ]; then
+        STAGE_METRICS_FILE=$(mktemp)
+    fi
+
+    # A failing stage must not exit the script before it is recorded, but its
+    # commands still stop at the first error. Running the subshell as the
+    # operand of || would disable that, even with set -e inside, as does a
+    # caller running the stage as a condition: the status of the command is
+    # checked explicitly for that case.
+    set +e
+    (
+        set -e
+        "${@:3}" || exit $?
+
+        # Once the subshell becomes python, its children usage includes the peak
+        # RSS of every process of the stage
+        if [ -n "${STAGE_METRICS_FILE}" ]; then
+            exec python3 -c 'import resource; print(",\"max_rss_kb\":%d" % resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss, end="")' \
+                >> "${STAGE_METRICS_FILE}"
+        fi
+    )
+    STAGE_STATUS=$?
+    set -e
+    STAGE_WALL=$(awk "BEGIN { printf \"%.3f\", ${EPOCHREALTIME} - ${STAGE_START} }")
+
+    if [ -n "${SYNC_TIMINGS}" ]; then
+        printf '%s\t%s\t%s\n' "$1" "$2" ${STAGE_WALL} >> "${SYNC_TIMINGS}"
+    fi
+    if [ -n "${SYNC_METRICS}" ]; then
+        printf '{"job":"%s","scope":"%s","stage":"%s","status":%d,"start":%s,"wall_seconds":%s%s}\n' \
+            "${CI_JOB_ID}" "$1" "$2" ${STAGE_STATUS} ${STAGE_START} ${STAGE_WALL} \
+            "$(cat ${STAGE_METRICS_FILE})" >> "${SYNC_METRICS}"
+        rm -f ${STAGE_METRICS_FILE}
+    fi
+    return ${STAGE_STATUS}
+}
+
+# Add a metric to the running stage
+# Usage: stage_metric NAME VALUE
+stage_metric() {
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        printf ',"%s":%s' "$1" "$2" >> "${STAGE_METRICS_FILE}"
+    fi
+}
+
+# Usage: objects_size GIT_DIR
+objects_size() {
+    if [ -d "$1/objects" ]; then
+        du -sb "$1/objects" | cut -f1
+    else
+        echo 0
+    fi
+}
+
+# Number of objects stored in a repository, without its alternates
+# Usage: local_objects GIT_DIR
+local_objects() {
+    git --git-dir="$1" count-objects -v | awk '/^(count|in-pack):/ { n += $2 } END { print n }'
+}
+
+for MIRROR in ${PUSH_MIRRORS}
+do
+    MIRROR_URL_VAR="PUSH_MIRROR_${MIRROR}_URL"
+    [ -n "${!MIRROR_URL_VAR}" ] || die "${MIRROR_URL_VAR} is not set"
+done
+
+if [ "${INCREMENTAL}" = "1" ] && [ "${UNION_FILTER}" = "1" ]; then
+    die "INCREMENTAL and UNION_FILTER can't be used together"
+fi
+
+# IDF branches already cloned during this run, so that every sync definition
+# of the same branch reuses a single clone
+declare -A IDF_CLONED
+
+# Usage: idf_source_dir ESP_IDF_BRANCH
+idf_source_dir() {
+    echo "download_idf-${1//\//_}"
+}
+
+# Usage: update_idf_mirror ESP_IDF_BRANCH
+update_idf_mirror() {
+    if [ ! -d "${IDF_MIRROR_DIR}" ]; then
+        git init --bare "${IDF_MIRROR_DIR}"
+    fi
+
+    git -C "${IDF_MIRROR_DIR}" config remote.origin.url "${IDF_URL}"
+    if [ "${PARTIAL_CLONE}" = "1" ]; then
+        git -C "${IDF_MIRROR_DIR}" fetch --filter=blob:none origin "+refs/heads/$1:refs/heads/$1"
+    else
+        git -C "${IDF_MIRROR_DIR}" fetch origin "+refs/heads/$1:refs/heads/$1"
+    fi
+}
+
+# Fetch the blobs of the synced paths of an IDF branch that are missing from a
+# partial clone, with a single request instead of one lazy fetch per blob
+# Usage: prefetch_blobs REPO_DIR ESP_IDF_BRANCH
+prefetch_blobs() {
+    SPARSE_SPEC=$(branch_paths "$2" | sed 's|^|/|' | git -C "$1" hash-object -w --stdin)
+
+    git -C "$1" rev-list --objects --missing=print --filter=sparse:oid=${SPARSE_SPEC} "$2" |
+        sed -n 's/^?//p' > missing_blobs.txt
+
+    # Files read only at the tip: .gitmodules by vendor_submodules, and the ones
+    # of the other components by the deps stage
+    TIP_FILES=()
+    if [ "${VENDOR_SUBMODULES}" = "1" ]; then
+        TIP_FILES+=(/.gitmodules)
+    fi
+    if [ "${DEPS_CHECK}" = "1" ]; then
+        TIP_FILES+=("${DEPS_FILES[@]}")
+    fi
+    if [ ${#TIP_FILES[@]} -gt 0 ]; then
+        TIP_SPEC=$(printf '%s\n' "${TIP_FILES[@]}" | git -C "$1" hash-object -w --stdin)
+        git -C "$1" rev-list --no-walk --objects --missing=print --filter=sparse:oid=${TIP_SPEC} "$2" |
+            sed -n 's/^?//p' >> missing_blobs.txt
+    fi
+
+    echo "Fetching $(cat missing_blobs.txt | wc -l) blobs of the synced paths"
+    if [ -s missing_blobs.txt ]; then
+        git -C "$1" -c fetch.negotiationAlgorithm=noop fetch origin --no-tags \
+            --no-write-fetch-head --recurse-submodules=no --filter=blob:none --stdin < missing_blobs.txt
+    fi
+    rm -f missing_blobs.txt
+}
+
 # Usage: clone_idf ESP_IDF_BRANCH
 clone_idf() {
-    rm -rf download_idf
-    git clone --single-branch --branch "$1" "${IDF_URL}" download_idf
+    if [ -n "${IDF_CLONED[$1]}" ]; then
+        echo "Reusing ESP-IDF ($1) clone in $(idf_source_dir "$1")"
+        return
+    fi
+
+    run_stage "$1" clone fetch_idf_branch "$1"
+    IDF_CLONED[$1]=1
+}
+
+# Usage: fetch_idf_branch ESP_IDF_BRANCH
+fetch_idf_branch() {
+    SRC_DIR=$(idf_source_dir "$1")
+
+    rm -rf ${SRC_DIR}
+    # Where the new objects are downloaded to
+    FETCH_DIR=${IDF_MIRROR_DIR:-${SRC_DIR}}
+    FETCHED_BEFORE=$(objects_size ${FETCH_DIR})
+
+    # Every repository of the sync is bare: nothing reads a working tree, and
+    # checking out IDF would write its whole tree, and need every blob
+    if [ "${PARTIAL_CLONE}" = "1" ]; then
+        if [ -n "${IDF_MIRROR_DIR}" ]; then
+            update_idf_mirror "$1"
+            prefetch_blobs "${IDF_MIRROR_DIR}" "$1"
+            git clone --bare --shared --single-branch --branch "$1" "${IDF_MIRROR_DIR}" ${SRC_DIR}
+        else
+            git clone --bare --filter=blob:none --single-branch --branch "$1" "${IDF_URL}" ${SRC_DIR}
+            prefetch_blobs ${SRC_DIR} "$1"
+        fi
+    elif [ -n "${IDF_MIRROR_DIR}" ]; then
+        update_idf_mirror "$1"
+        git clone --bare --shared --single-branch --branch "$1" "${IDF_MIRROR_DIR}" ${SRC_DIR}
+    else
+        git clone --bare --single-branch --branch "$1" "${IDF_URL}" ${SRC_DIR}
+    fi
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric bytes_received $(($(objects_size ${FETCH_DIR}) - FETCHED_BEFORE))
+        stage_metric objects $(local_objects ${FETCH_DIR})
+        stage_metric commits $(git -C ${SRC_DIR} rev-list --count "refs/heads/$1")
+    fi
 }
 
-# Usage: find_pattern STRING
-find_pattern() {
-    git --no-pager log -i --grep "$1" > issue_found.txt
-    if [[ $(cat issue_found.txt | wc -l) > 0 ]]; then
-        ISSUE_NUM=$(grep "^commit " issue_found.txt | wc -l)
-        die "${ISSUE_NUM} $1 found. See issue_found.txt"
+# Links which must not remain in the rewritten commit messages (extended
+# regular expressions, matched case-insensitively on each line)
+LINK_PATTERNS=(
+    'github.com/[^ /]*/[^ /]*/(issues|pull)'
+    'espressif/esp-idf[!#$&~%^]'
+)
+
+# Print the published tip of a sync branch when the current repository has it
+# Usage: local_published_tip SYNC_BRANCH_NAME
+local_published_tip() {
+    PUBLISHED_TIP=$(git ls-remote ${ESP_HAL_3RDPARTY_URL} "refs/heads/$1" | cut -f1)
+    if [ -n "${PUBLISHED_TIP}" ] && git cat-file -e "${PUBLISHED_TIP}^{commit}"; then
+        echo ${PUBLISHED_TIP}
     fi
 }
 
+# Check the messages of the commits not published yet for every link pattern,
+# in a single walk of the history. The published commits were checked before.
+# Usage: check_links SYNC_BRANCH_NAME
 check_links() {
-    find_pattern 'github.com/[^ /]*/[^ /]*/\(issues\|pull\)'
-    find_pattern 'espressif/esp-idf[!#$&~%^]'
+    SCAN_RANGE="HEAD"
+    PUBLISHED_TIP=$(local_published_tip "$1")
+    if [ -n "${PUBLISHED_TIP}" ]; then
+        SCAN_RANGE+=" --not ${PUBLISHED_TIP}"
+    fi
+
+    git log --format='%x01%H%n%B' ${SCAN_RANGE} |
+        awk -v patterns="$(printf '%s\n' "${LINK_PATTERNS[@]}")" '
+            BEGIN { n = split(patterns, pattern, "\n") }
+            substr($0, 1, 1) == "\001" { commit = substr($0, 2); next }
+            {
+                line = tolower($0)
+                for (i = 1; i <= n; i++) {
+                    if (line ~ pattern[i] && !((commit, i) in found)) {
+                        found[commit, i] = 1
+                        printf "%s\t%s\t%s\n", commit, pattern[i], $0
+                    }
+                }
+            }' > issue_found.txt
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric commits $(git rev-list --count ${SCAN_RANGE})
+    fi
+
+    if [ -s issue_found.txt ]; then
+        head -n 20 issue_found.txt
+        die "$(cut -f1 issue_found.txt | sort -u | wc -l) commits with links found. See issue_found.txt"
+    fi
+}
+
+# Remote ref holding the filter-repo state of a sync branch
+# Usage: state_ref SYNC_BRANCH_NAME
+state_ref() {
+    echo "refs/sync-state/$1"
+}
+
+# Remote ref recording the upstream tip and the arguments of the last sync
+# Usage: record_ref SYNC_BRANCH_NAME
+record_ref() {
+    echo "refs/sync-record/$1"
+}
+
+# A message rules file counts with its content, wherever the script runs from
+# Usage: args_fingerprint ARGS...
+args_fingerprint() {
+    for ARG in "$@"
+    do
+        if [ "${PREVIOUS_ARG}" = "--replace-message" ]; then
+            ARG=$(cat "${ARG}")
+        fi
+        printf '%q ' "${ARG}"
+        PREVIOUS_ARG=${ARG}
+    done | git hash-object --stdin
+}
+
+# Remote ref holding the index between the upstream and the sync commits
+# Usage: map_ref SYNC_BRANCH_NAME
+map_ref() {
+    echo "refs/sync-map/$1"
+}
+
+# Create a commit of a tree, parentless unless -p options are given, with the
+# message read from stdin
+# Usage: sync_commit_tree TREE [-p PARENT...]
+sync_commit_tree() {
+    git -c user.name="esp-hal-3rdparty sync" -c user.email="sync@localhost" commit-tree "$@"
+}
+
+# Publish the record of a sync made from UPSTREAM_TIP, as a parentless commit
+# with an empty tree, so that no IDF object is pushed with it
+# Usage: push_sync_record SYNC_BRANCH_NAME UPSTREAM_TIP ARGS...
+push_sync_record() {
+    RECORD=$(printf 'upstream %s\nargs %s\n' "$2" "$(args_fingerprint "${@:3}")" |
+        sync_commit_tree $(git mktree < /dev/null))
+    git push ${ESP_HAL_3RDPARTY_URL} "+${RECORD}:$(record_ref $1)"
+}
+
+# Print the "UPSTREAM SYNC" pairs of a filter-repo commit map, without its
+# header nor the pruned commits
+# Usage: commit_map_pairs COMMIT_MAP
+commit_map_pairs() {
+    awk 'NR > 1 && $2 !~ /^0+$/ { print $1, $2 }' "$1"
+}
+
+# Write the index of a sync branch to its map ref in the current repository. Its
+# tree holds upstream-to-sync and sync-to-upstream, two sorted tables of fixed
+# width "COMMIT COMMIT" lines which tools/sync_map_lookup.sh bisects. The
+# published index is extended with the commits filtered by this run, mapped
+# through the union history when its commit map is given. The entries of this
+# run replace the published ones of the same upstream commits, which point to a
+# replaced history after a full rewrite which changed the SHAs.
+# Usage: write_sync_map SYNC_BRANCH_NAME [UNION_COMMIT_MAP]
+write_sync_map() {
+    COMMIT_MAP=$(git rev-parse --git-dir)/filter-repo/commit-map
+
+    {
+        if [ -n "$2" ]; then
+            join -1 2 -2 1 <(commit_map_pairs "$2" | sort -k2,2) \
+                <(commit_map_pairs ${COMMIT_MAP} | sort -k1,1) | awk '{ print $2, $3 }'
+        else
+            commit_map_pairs ${COMMIT_MAP}
+        fi
+        if git fetch ${ESP_HAL_3RDPARTY_URL} "+$(map_ref $1):$(map_ref $1)" >&2; then
+            git cat-file blob "$(map_ref $1):upstream-to-sync"
+        fi
+    } | LC_ALL=C sort -s -u -k1,1 > upstream-to-sync
+    awk '{ print $2, $1 }' upstream-to-sync | LC_ALL=C sort > sync-to-upstream
+
+    TREE=$(printf '100644 blob %s\t%s\n' \
+        $(git hash-object -w sync-to-upstream) sync-to-upstream \
+        $(git hash-object -w upstream-to-sync) upstream-to-sync | git mktree)
+    git update-ref $(map_ref $1) $(echo "Commit map of $1" | sync_commit_tree ${TREE})
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric commits $(cat upstream-to-sync | wc -l)
+    fi
+    rm -f upstream-to-sync sync-to-upstream
+}
+
+# Fetch the record of the last sync of a branch into refs/sync-record, and
+# return 0 when that sync used the same arguments
+# Usage: args_recorded SYNC_BRANCH_NAME ARGS...
+args_recorded() {
+    git fetch ${ESP_HAL_3RDPARTY_URL} "+$(record_ref $1):refs/sync-record" || return 1
+    [ "$(git log -1 --format=%B refs/sync-record | sed -n 's/^args //p')" = "$(args_fingerprint "${@:2}")" ]
+}
+
+# Returns 0 when nothing synced by a definition changed upstream since its last
+# recorded sync. When the upstream tip moved without touching the synced paths,
+# which needs the IDF mirror to find out, the new tip is recorded.
+# Usage: sync_is_current ESP_IDF_BRANCH SYNC_BRANCH_NAME ARGS...
+sync_is_current() (
+    if [ ! -d "${SYNC_CHECK_DIR}" ]; then
+        git init --bare "${SYNC_CHECK_DIR}"
+    fi
+    cd "${SYNC_CHECK_DIR}"
+
+    args_recorded "$2" "${@:3}" || exit 1
+    RECORDED_TIP=$(git log -1 --format=%B refs/sync-record | sed -n 's/^upstream //p')
+
+    UPSTREAM_TIP=$(git ls-remote ${IDF_URL} "refs/heads/$1" | cut -f1)
+    [ -n "${UPSTREAM_TIP}" ] || exit 1
+    [ "${UPSTREAM_TIP}" != "${RECORDED_TIP}" ] || exit 0
+
+    [ -n "${IDF_MIRROR_DIR}" ] || exit 1
+    cd - > /dev/null
+    update_idf_mirror "$1" || exit 1
+    UPSTREAM_TIP=$(git -C "${IDF_MIRROR_DIR}" rev-parse "refs/heads/$1")
+    git -C "${IDF_MIRROR_DIR}" cat-file -e "${RECORDED_TIP}^{commit}" || exit 1
+
+    # --full-history also counts the side branches of merges
+    CHANGES=$(git -C "${IDF_MIRROR_DIR}" rev-list --count --full-history \
+        "${RECORDED_TIP}..${UPSTREAM_TIP}" -- $(path_prefixes "${@:3}"))
+    [ "${CHANGES}" = "0" ] || exit 1
+
+    cd "${SYNC_CHECK_DIR}"
+    push_sync_record "$2" "${UPSTREAM_TIP}" "${@:3}" || exit 1
+)
+
+# Fetch the published sync branch into refs/remotes/published/. Returns
+# non-zero when the branch was never published.
+# Usage: fetch_published SYNC_BRANCH_NAME
+fetch_published() {
+    git fetch ${ESP_HAL_3RDPARTY_URL} "+refs/heads/$1:refs/remotes/published/$1"
+}
+
+# Fetch the published sync branch and its filter-repo state into the current
+# repository. Returns non-zero when there is nothing to continue from.
+# Usage: fetch_sync_state SYNC_BRANCH_NAME
+fetch_sync_state() {
+    git fetch ${ESP_HAL_3RDPARTY_URL} \
+        "+$(state_ref $1):refs/heads/${STATE_BRANCH}" \
+        "+refs/heads/$1:refs/remotes/published/$1" || return 1
+}
+
+# Rewrite the current repository with tools/filter_engine.py when FILTER_ENGINE
+# is native. Returns non-zero when filter-repo has to do it: for incremental
+# rewrites, and histories the engine can't rewrite (it updates nothing then).
+# Usage: native_filter ARGS...
+native_filter() {
+    [ "${FILTER_ENGINE}" = "native" ] && [[ " $* " != *" --refs "* ]] || return 1
+
+    ENGINE_STATUS=0
+    python3 ${SCRIPT_DIR}/filter_engine.py --jobs ${FILTER_JOBS} \
+        ${FILTER_CACHE_DIR:+--cache-dir "${FILTER_CACHE_DIR}"} "$@" || ENGINE_STATUS=$?
+    if [ ${ENGINE_STATUS} -eq 3 ]; then
+        echo "Falling back to git filter-repo"
+        return 1
+    fi
+    [ ${ENGINE_STATUS} -eq 0 ] || die "filter_engine.py failed with status ${ENGINE_STATUS}"
+}
+
+# Run filter-repo in the current repository, recording what it processed.
+# Returns the status of the rewrite, also when set -e is ignored.
+# Usage: filter_repo RESULT_REF ARGS...
+filter_repo() {
+    native_filter "${@:2}" || git filter-repo "${@:2}" || return
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        # The commit map has a header line
+        stage_metric commits $(($(cat $(git rev-parse --git-dir)/filter-repo/commit-map | wc -l) - 1))
+        stage_metric commits_kept $(git rev-list --count "$1")
+        stage_metric objects $(local_objects $(git rev-parse --git-dir))
+    fi
+}
+
+# Usage: create_workspace SOURCE_DIR ESP_IDF_BRANCH FOLDER_NAME
+create_workspace() {
+    rm -rf $3
+    # Borrow the objects of the source repository through alternates instead of
+    # copying them, filter-repo only writes the rewritten objects and refs locally
+    git clone --bare --shared --single-branch --branch "$2" $1 $3
+}
+
+# Print the path selection arguments of a filter-repo argument list, one per
+# line, as regular expressions must not go through word splitting
+# Usage: path_args ARGS...
+path_args() {
+    while [ $# -gt 0 ]
+    do
+        if [ "$1" = "--path" ] || [ "$1" = "--path-regex" ]; then
+            printf '%s\n' "$1" "$2"
+            shift
+        fi
+        shift
+    done
+}
+
+# Print the paths selected by a filter-repo argument list, with the literal
+# prefix of each regular expression, for pathspecs and sparse specs
+# Usage: path_prefixes ARGS...
+path_prefixes() {
+    while [ $# -gt 0 ]
+    do
+        if [ "$1" = "--path" ]; then
+            echo "$2"
+            shift
+        elif [ "$1" = "--path-regex" ]; then
+            echo "$2" | sed 's/^\^//; s/[][(){}.*+?|\\$].*//; s|/$||'
+            shift
+        fi
+        shift
+    done
+}
+
+# Usage: union_dir ESP_IDF_BRANCH
+union_dir() {
+    echo "union-${1//\//_}"
+}
+
+# Filter an IDF branch with the union of the paths of its sync definitions.
+# The message callback and any other option are only applied here.
+# Usage: filter_union ESP_IDF_BRANCH ARGS...
+filter_union() {
+    run_stage "$1" copy create_workspace $(idf_source_dir "$1") "$1" $(union_dir "$1")
+
+    pushd $(union_dir "$1")
+    run_stage "$1" filter filter_repo "$1" "${@:2}"
+    popd
+}
+
+# Derive a sync branch from the union history of its IDF branch. Filtering a
+# subset of the paths again gives the same commits as filtering the IDF history
+# directly, which is checked against the published branch: returns non-zero
+# when the result does not continue it.
+# Usage: derive_from_union ESP_IDF_BRANCH SYNC_BRANCH_NAME FOLDER_NAME ARGS...
+derive_from_union() (
+    create_workspace $(union_dir "$1") "$1" $3 || exit 1
+    cd $3 || exit 1
+
+    mapfile -t SYNC_PATH_ARGS < <(path_args "${@:4}")
+    filter_repo "$1" "${SYNC_PATH_ARGS[@]}" || exit 1
+
+    if fetch_published "$2" &&
+        ! git merge-base --is-ancestor "refs/remotes/published/$2" "$1"; then
+        echo "$2 derived from the union history diverges from the published branch"
+        exit 1
+    fi
+)
+
+# Returns 0 when a sync branch can be rewritten incrementally. A verification
+# only reuses the published commits when they were made with the same arguments.
+# Usage: can_continue SYNC_BRANCH_NAME ARGS...
+can_continue() {
+    [ "${INCREMENTAL}" = "1" ] || return 1
+    if [ "${VERIFY}" = "1" ] && ! args_recorded "$@"; then
+        echo "Arguments of $1 changed since its last sync, verifying a full rewrite"
+        return 1
+    fi
+    fetch_sync_state "$1"
+}
+
+# Usage: filter_history ESP_IDF_BRANCH SYNC_BRANCH_NAME ARGS...
+filter_history() {
+    if can_continue "${@:2}"; then
+        echo "Incremental rewrite of $1 on top of the published $2"
+        # The marks in the state branch map every already synced upstream commit
+        # to its rewritten one, so fast-export only emits the new commits and
+        # fast-import attaches them to the existing history with the same SHAs.
+        filter_repo "$1" --force --state-branch ${STATE_BRANCH} --refs "$1" "${@:3}"
+
+        git merge-base --is-ancestor "refs/remotes/published/$2" "$1" ||
+            die "Incremental rewrite of $2 does not descend from the published tip"
+    else
+        filter_repo "$1" --state-branch ${STATE_BRANCH} "${@:3}"
+    fi
+}
+
+# Print how two commits differ, among the fields their SHA depends on
+# Usage: commit_differences PUBLISHED_COMMIT REBUILT_COMMIT
+commit_differences() {
+    for FIELD in "author:%an <%ae>" "author date:%ad" "committer:%cn <%ce>" \
+        "committer date:%cd" "tree:%T"
+    do
+        PUBLISHED_VALUE=$(git log -1 --date=raw --format="${FIELD#*:}" $1)
+        REBUILT_VALUE=$(git log -1 --date=raw --format="${FIELD#*:}" $2)
+        if [ "${PUBLISHED_VALUE}" != "${REBUILT_VALUE}" ]; then
+            echo "  ${FIELD%%:*}: published '${PUBLISHED_VALUE}', rebuilt '${REBUILT_VALUE}'"
+        fi
+    done
+
+    if [ "$(git log -1 --format=%B $1)" != "$(git log -1 --format=%B $2)" ]; then
+        echo "  message:"
+        diff <(git log -1 --format=%B $1) <(git log -1 --format=%B $2) | sed 's/^/    /'
+    fi
+    if [ "$(git rev-parse $1^{tree})" != "$(git rev-parse $2^{tree})" ]; then
+        git diff --stat $1 $2 | sed 's/^/    /'
+    fi
+}
+
+# Compare a sync branch rebuilt from ESP_IDF_BRANCH with the published one. The
+# published tip must be the rebuilt tip or one of its ancestors, otherwise the
+# first published commit which was not rebuilt identically is reported, with
+# the rebuilt commit taking its place, i.e. the one with the same parents.
+# Usage: verify_sync ESP_IDF_BRANCH SYNC_BRANCH_NAME
+verify_sync() {
+    if ! fetch_published "$2"; then
+        echo "$2 was never published, nothing to compare with"
+        return
+    fi
+    PUBLISHED="refs/remotes/published/$2"
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric commits $(git rev-list --count "$1")
+    fi
+
+    if git merge-base --is-ancestor ${PUBLISHED} "$1"; then
+        echo "$2 verified: published tip $(git rev-parse ${PUBLISHED}) rebuilt identically," \
+            "$(git rev-list --count ${PUBLISHED}..$1) new commits on top"
+        return
+    fi
+
+    DIVERGED=$(git rev-list --reverse --topo-order ${PUBLISHED} --not "$1" | head -n 1)
+    PARENTS=$(git rev-list --no-walk --parents ${DIVERGED} | cut -s -d' ' -f2-)
+    REBUILT=$(git rev-list --reverse --topo-order --parents "$1" --not ${PUBLISHED} |
+        awk -v parents="${PARENTS}" '{ p = $0; sub(/^[^ ]+ ?/, "", p) } p == parents { print $1; exit }')
+
+    echo "$2 diverges from the published branch at ${DIVERGED}:"
+    git log -1 --format='  %h %s' ${DIVERGED}
+    if [ -z "${REBUILT}" ]; then
+        echo "  no rebuilt commit has the same parents, commits were added or pruned"
+    else
+        UPSTREAM=$(awk -v rebuilt=${REBUILT} '$2 == rebuilt { print $1; exit }' \
+            $(git rev-parse --git-dir)/filter-repo/commit-map)
+        echo "  rebuilt as ${REBUILT}${UPSTREAM:+ from upstream ${UPSTREAM}}"
+        commit_differences ${DIVERGED} ${REBUILT}
+    fi
+    die "Rebuilt $2 can't be pushed on top of the published branch"
+}
+
+# Print, one per line, the refspecs pushed to a mirror: the destination of each
+# refspec is mapped by the first matching pattern, and dropped when none does
+# Usage: mirror_refspecs "PATTERN:DESTINATION..." REFSPECS...
+mirror_refspecs() {
+    for REFSPEC in "${@:2}"
+    do
+        FORCE=""
+        if [ "${REFSPEC:0:1}" = "+" ]; then
+            FORCE="+"
+            REFSPEC=${REFSPEC:1}
+        fi
+        SRC=${REFSPEC%%:*}
+        DST=${REFSPEC#*:}
+        if [ "${DST#refs/}" = "${DST}" ]; then
+            DST="refs/heads/${DST}"
+        fi
+
+        read -ra MAPPINGS <<< "$1"
+        for MAPPING in "${MAPPINGS[@]}"
+        do
+            PATTERN=${MAPPING%%:*}
+            DESTINATION=${MAPPING#*:}
+            if [[ "${DST}" == ${PATTERN} ]]; then
+                # What the '*' of the pattern matched
+                MATCHED=${DST#"${PATTERN%%\**}"}
+                MATCHED=${MATCHED%"${PATTERN#*\*}"}
+                echo "${FORCE}${SRC}:${DESTINATION/\*/${MATCHED}}"
+                break
+            fi
+        done
+    done
+}
+
+# Push refspecs once. An atomic push updates all the refs or none of them. A
+# remote which can't do atomic pushes gets the first refspec, the sync branch,
+# alone first, so that the refs describing the branch (state, map, libs) are
+# never updated for a branch which was rejected.
+# Usage: push_refs URL atomic|ordered REFSPECS...
+push_refs() {
+    GIT_PUSH=(git -c pack.window=${PACK_WINDOW} -c pack.depth=${PACK_DEPTH} push)
+    if [ "$2" = "atomic" ]; then
+        "${GIT_PUSH[@]}" --atomic "$1" "${@:3}"
+    else
+        "${GIT_PUSH[@]}" "$1" "$3" && { [ $# -le 3 ] || "${GIT_PUSH[@]}" "$1" "${@:4}"; }
+    fi
+}
+
+# Usage: push_with_retries REMOTE_NAME URL atomic|ordered REFSPECS...
+push_with_retries() {
+    for ATTEMPT in $(seq ${PUSH_RETRIES})
+    do
+        if push_refs "$2" "${@:3}"; then
+            return 0
+        fi
+        echo "Push to $1 failed, attempt ${ATTEMPT} of ${PUSH_RETRIES}"
+        if [ ${ATTEMPT} -lt ${PUSH_RETRIES} ]; then
+            sleep $((ATTEMPT * PUSH_RETRY_DELAY))
+        fi
+    done
+    return 1
+}
+
+# Push a sync branch from the current repository to ESP_HAL_3RDPARTY_URL and
+# every mirror in parallel, recording what is sent and how old the synced
+# upstream commit is. Fails when any push failed, once all of them are done.
+# Usage: push_sync SYNC_BRANCH_NAME UPSTREAM_TIP REFSPECS...
+push_sync() {
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        NEW_OBJECTS="$1"
+        PUBLISHED_TIP=$(local_published_tip "$1")
+        if [ -n "${PUBLISHED_TIP}" ]; then
+            NEW_OBJECTS+=" --not ${PUBLISHED_TIP}"
+        fi
+        stage_metric commits $(git rev-list --count ${NEW_OBJECTS})
+        stage_metric objects $(git rev-list --objects ${NEW_OBJECTS} | wc -l)
+        stage_metric bytes_sent $(git rev-list --objects --disk-usage ${NEW_OBJECTS})
+        stage_metric upstream_lag_seconds $(($(date +%s) - $(git log -1 --format=%ct "$2")))
+    fi
+
+    declare -A PUSH_PIDS
+    push_with_retries origin ${ESP_HAL_3RDPARTY_URL} atomic "${@:3}" > push-origin.log 2>&1 &
+    PUSH_PIDS[origin]=$!
+
+    for MIRROR in ${PUSH_MIRRORS}
+    do
+        MIRROR_URL_VAR="PUSH_MIRROR_${MIRROR}_URL"
+        MIRROR_REFS_VAR="PUSH_MIRROR_${MIRROR}_REFS"
+        mapfile -t MIRROR_REFSPECS < <(mirror_refspecs "${!MIRROR_REFS_VAR:-refs/heads/*:refs/heads/*}" "${@:3}")
+        if [ ${#MIRROR_REFSPECS[@]} -eq 0 ]; then
+            echo "Nothing to push to ${MIRROR}"
+            continue
+        fi
+        push_with_retries ${MIRROR} "${!MIRROR_URL_VAR}" ordered "${MIRROR_REFSPECS[@]}" > push-${MIRROR}.log 2>&1 &
+        PUSH_PIDS[${MIRROR}]=$!
+    done
+
+    FAILED=""
+    for REMOTE in "${!PUSH_PIDS[@]}"
+    do
+        if wait ${PUSH_PIDS[$REMOTE]}; then
+            echo "Pushed $1 to ${REMOTE}:"
+        else
+            echo "Push of $1 to ${REMOTE} failed:"
+            FAILED+="${REMOTE} "
+        fi
+        sed 's/^/    /' push-${REMOTE}.log
+        rm -f push-${REMOTE}.log
+    done
+
+    stage_metric remotes ${#PUSH_PIDS[@]}
+    stage_metric remotes_failed $(echo ${FAILED} | wc -w)
+    [ -z "${FAILED}" ] || die "Push of $1 failed for: ${FAILED}"
+}
+
+# Bundle refs of the current repository to a file of SYNC_BUNDLE_DIR, which
+# appears once complete, and print its size
+# Usage: create_bundle FILE REVS...
+create_bundle() {
+    git bundle create ${SYNC_BUNDLE_DIR}/$1.tmp "${@:2}"
+    mv ${SYNC_BUNDLE_DIR}/$1.tmp ${SYNC_BUNDLE_DIR}/$1
+    stat -c %s ${SYNC_BUNDLE_DIR}/$1
+}
+
+# Write the bundles of a sync branch of the current repository to SYNC_BUNDLE_DIR:
+# a full one replacing the previous one, and an incremental one from the previous
+# tip when the branch only got new commits. When its history was rewritten, its
+# incremental bundles are dropped, consumers start again from the full one.
+# The index has one "SYNC_BRANCH TIP PREREQUISITE FILE BYTES" line per bundle,
+# "-" being the prerequisite of the full bundles.
+# Usage: write_bundles SYNC_BRANCH_NAME
+write_bundles() {
+    INDEX=${SYNC_BUNDLE_DIR}/bundles.txt
+    TIP=$(git rev-parse refs/heads/$1)
+    mkdir -p ${SYNC_BUNDLE_DIR}/$1
+
+    # Parallel sync jobs update the same index
+    exec 9> ${SYNC_BUNDLE_DIR}/bundles.lock
+    flock 9
+    touch ${INDEX}
+
+    LAST_TIP=$(awk -v sync="$1" '$1 == sync && $3 == "-" { print $2 }' ${INDEX})
+    if [ "${LAST_TIP}" = "${TIP}" ]; then
+        echo "Bundles of $1 are up to date"
+        return
+    fi
+
+    INCREMENTAL_BUNDLES=""
+    if [ -n "${LAST_TIP}" ] && git cat-file -e ${LAST_TIP} 2> /dev/null &&
+        git merge-base --is-ancestor ${LAST_TIP} ${TIP}; then
+        FILE=$1/${LAST_TIP:0:12}-${TIP:0:12}.bundle
+        SIZE=$(create_bundle ${FILE} refs/heads/$1 ^${LAST_TIP})
+        stage_metric incremental_bytes ${SIZE}
+        INCREMENTAL_BUNDLES=$(awk -v sync="$1" '$1 == sync && $3 != "-"' ${INDEX}
+            echo "$1 ${TIP} ${LAST_TIP} ${FILE} ${SIZE}")
+    fi
+
+    FILE=$1/full-${TIP:0:12}.bundle
+    SIZE=$(create_bundle ${FILE} refs/heads/$1)
+    stage_metric bytes ${SIZE}
+
+    {
+        awk -v sync="$1" '$1 != sync' ${INDEX}
+        echo "$1 ${TIP} - ${FILE} ${SIZE}"
+        if [ ${SYNC_BUNDLE_KEEP} -gt 0 ] && [ -n "${INCREMENTAL_BUNDLES}" ]; then
+            echo "${INCREMENTAL_BUNDLES}" | tail -n ${SYNC_BUNDLE_KEEP}
+        fi
+    } > ${INDEX}.tmp
+    mv ${INDEX}.tmp ${INDEX}
+
+    for BUNDLE in ${SYNC_BUNDLE_DIR}/$1/*.bundle
+    do
+        awk -v file="${BUNDLE#${SYNC_BUNDLE_DIR}/}" '$4 == file { found = 1 } END { exit !found }' ${INDEX} ||
+            rm -f ${BUNDLE}
+    done
+}
+
+# Repack the repository the sync branches are pushed to, see tools/optimize_repo.sh
+# Usage: optimize_remote
+optimize_remote() {
+    [ -d "${ESP_HAL_3RDPARTY_URL}" ] || die "OPTIMIZE_REMOTE needs a local ESP_HAL_3RDPARTY_URL"
+
+    PACK_WINDOW=${PACK_WINDOW} PACK_DEPTH=${PACK_DEPTH} \
+        $(dirname $0)/optimize_repo.sh "${ESP_HAL_3RDPARTY_URL}"
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric objects $(local_objects "${ESP_HAL_3RDPARTY_URL}")
+        stage_metric bytes $(objects_size "${ESP_HAL_3RDPARTY_URL}")
+    fi
+}
+
+# Branch holding a sync branch with its submodules vendored
+# Usage: libs_branch SYNC_BRANCH_NAME
+libs_branch() {
+    echo "libs/$1"
+}
+
+# Print the URL of the submodule at a path of an IDF commit, resolving the
+# relative URLs against IDF_URL as git does
+# Usage: submodule_url IDF_SOURCE_DIR COMMIT PATH
+submodule_url() {
+    NAME=$(git -C $1 config --blob "$2:.gitmodules" --get-regexp '^submodule\..*\.path$' |
+        awk -v path="$3" '$2 == path { sub(/^submodule\./, "", $1); sub(/\.path$/, "", $1); print $1 }')
+    [ -n "${NAME}" ] || die "No submodule at $3 in .gitmodules of $2"
+    URL=$(git -C $1 config --blob "$2:.gitmodules" "submodule.${NAME}.url")
+
+    if [ "${URL#./}" = "${URL}" ] && [ "${URL#../}" = "${URL}" ]; then
+        echo "${URL}"
+        return
+    fi
+    BASE=${IDF_URL%/}
+    URL=${URL#./}
+    while [ "${URL#../}" != "${URL}" ]
+    do
+        URL=${URL#../}
+        BASE=${BASE%/*}
+    done
+    echo "${BASE}/${URL}"
+}
+
+# Commit on the libs branch of a sync branch its tip with the content of its
+# submodules, pruned with the same path selection, so that a shallow clone of
+# that single branch gets everything. The parents are the previous libs commit
+# and the vendored sync commit, and the message lists the submodule commits:
+# only the ones which changed since the previous libs commit are fetched.
+# Usage: vendor_submodules ESP_IDF_BRANCH SYNC_BRANCH_NAME UPSTREAM_TIP ARGS...
+vendor_submodules() {
+    LIBS_REF="refs/heads/$(libs_branch $2)"
+    SYNC_TIP=$(git rev-parse "$1")
+    git ls-tree -r "$1" | awk '$2 == "commit" { print $3, $4 }' > gitlinks.txt
+    if [ ! -s gitlinks.txt ]; then
+        echo "No submodule to vendor in $2"
+        rm gitlinks.txt
+        return
+    fi
+
+    # The fetches don't use the refs of the IDF clone the workspace borrows its
+    # objects from: with PARTIAL_CLONE=1 the check of what they receive would
+    # walk these unfiltered commits, and fail on their missing blobs
+    NO_ALTERNATE_REFS="-c core.alternateRefsCommand=true"
+
+    PREVIOUS=""
+    if git ${NO_ALTERNATE_REFS} fetch --depth 1 ${ESP_HAL_3RDPARTY_URL} "+${LIBS_REF}:${LIBS_REF}"; then
+        PREVIOUS=$(git rev-parse ${LIBS_REF})
+        if git cat-file commit ${PREVIOUS} | grep -qx "sync ${SYNC_TIP}"; then
+            echo "$(libs_branch $2) is up to date"
+            rm gitlinks.txt
+            return
+        fi
+    fi
+
+    # Paths of the submodules are only filtered by the regular expressions,
+    # the --path selection keeps them whole
+    SUBMODULES=$(cat gitlinks.txt | wc -l)
+    PATH_REGEX=$(path_args "${@:4}" | awk 'previous == "--path-regex" { printf "%s(?:%s)", sep, $0; sep = "|" } { previous = $0 }')
+    FETCHED_BEFORE=$(objects_size $(git rev-parse --git-dir))
+
+    # The tree is built in a temporary index, update-index needs a work tree but
+    # never reads it here
+    export GIT_INDEX_FILE=$(git rev-parse --git-dir)/libs-index
+    export GIT_WORK_TREE=$(mktemp -d)
+    git read-tree "$1"
+    # Lines of the message, printed as data: a submodule path is no printf format
+    MESSAGE=("Vendored submodules of $2 at ${SYNC_TIP}" "" "sync ${SYNC_TIP}")
+    while read GITLINK GITLINK_PATH
+    do
+        git update-index --force-remove "${GITLINK_PATH}"
+        if [ -n "${PREVIOUS}" ] && git cat-file commit ${PREVIOUS} | grep -qx "submodule ${GITLINK_PATH} ${GITLINK}"; then
+            git read-tree --prefix="${GITLINK_PATH}/" "${PREVIOUS}:${GITLINK_PATH}"
+        else
+            git ${NO_ALTERNATE_REFS} fetch --depth 1 --no-tags --no-write-fetch-head \
+                "$(submodule_url ../$(idf_source_dir "$1") "$3" "${GITLINK_PATH}")" ${GITLINK} < /dev/null
+            git read-tree --prefix="${GITLINK_PATH}/" "${GITLINK}^{tree}"
+            if [ -n "${PATH_REGEX}" ]; then
+                git ls-files -- "${GITLINK_PATH}/" | grep -vP "${PATH_REGEX}" |
+                    git update-index --force-remove --stdin
+            fi
+        fi
+        MESSAGE+=("submodule ${GITLINK_PATH} ${GITLINK}")
+    done < gitlinks.txt
+
+    git update-ref ${LIBS_REF} $(printf '%s\n' "${MESSAGE[@]}" |
+        sync_commit_tree $(git write-tree) ${PREVIOUS:+-p ${PREVIOUS}} -p ${SYNC_TIP})
+    rm -rf gitlinks.txt ${GIT_INDEX_FILE} ${GIT_WORK_TREE}
+    unset GIT_INDEX_FILE GIT_WORK_TREE
+
+    if [ -n "${STAGE_METRICS_FILE}" ]; then
+        stage_metric submodules ${SUBMODULES}
+        stage_metric bytes_received $(($(objects_size $(git rev-parse --git-dir)) - FETCHED_BEFORE))
+    fi
+}
+
+# Disk usage of the run in MiB
+# Usage: disk_usage
+disk_usage() {
+    du -smc . ${IDF_MIRROR_DIR} 2> /dev/null | tail -n 1 | cut -f1
+}
+
+# Usage: remove_workspace FOLDER_NAME
+remove_workspace() {
+    stage_metric disk_mib $(disk_usage)
+    if [ "${KEEP_WORKSPACES}" != "1" ]; then
+        rm -rf $1
+    fi
 }
 
 # Usage: extract_components ESP_IDF_BRANCH SYNC_BRANCH_NAME ARGS...
@@ -37,23 +1008,270 @@ extract_components() {
     echo "Cloning ESP-IDF (${ESP_IDF_BRANCH})"
 
     clone_idf "${ESP_IDF_BRANCH}"
+    UPSTREAM_TIP=$(git -C $(idf_source_dir "${ESP_IDF_BRANCH}") rev-parse "refs/heads/${ESP_IDF_BRANCH}")
 
     echo "Extract to branch ${SYNC_BRANCH_NAME} with arg list: '$ARGS'"
 
     FOLDER_NAME="esp-idf-${SYNC_BRANCH_NAME}"
 
-    rm -rf ${FOLDER_NAME}
-    cp -r download_idf ${FOLDER_NAME}
+    # Commit map of the union history the sync branch is derived from, if any
+    UNION_COMMIT_MAP=""
+
+    if [ "${UNION_FILTER}" = "1" ] &&
+        run_stage ${SYNC_BRANCH_NAME} derive \
+            derive_from_union "${ESP_IDF_BRANCH}" "${SYNC_BRANCH_NAME}" ${FOLDER_NAME} "${@:3}"; then
+        UNION_COMMIT_MAP=$(pwd)/$(union_dir "${ESP_IDF_BRANCH}")/filter-repo/commit-map
+        pushd ${FOLDER_NAME}
+    else
+        run_stage ${SYNC_BRANCH_NAME} copy \
+            create_workspace $(idf_source_dir "${ESP_IDF_BRANCH}") "${ESP_IDF_BRANCH}" ${FOLDER_NAME}
+
+        pushd ${FOLDER_NAME}
+        run_stage ${SYNC_BRANCH_NAME} filter \
+            filter_history "${ESP_IDF_BRANCH}" "${SYNC_BRANCH_NAME}" "${@:3}"
+    fi
+
+    if [ "${VERIFY}" = "1" ]; then
+        run_stage ${SYNC_BRANCH_NAME} verify verify_sync "${ESP_IDF_BRANCH}" ${SYNC_BRANCH_NAME}
+        run_stage ${SYNC_BRANCH_NAME} check_links check_links ${SYNC_BRANCH_NAME}
+        popd
+        run_stage ${SYNC_BRANCH_NAME} clean remove_workspace ${FOLDER_NAME}
+        return
+    fi
+
+    run_stage ${SYNC_BRANCH_NAME} check_links check_links ${SYNC_BRANCH_NAME}
 
-    pushd ${FOLDER_NAME}
-    git filter-repo "${@:3}"
+    git branch -f ${SYNC_BRANCH_NAME} "${ESP_IDF_BRANCH}"
 
-    check_links
+    run_stage ${SYNC_BRANCH_NAME} map write_sync_map ${SYNC_BRANCH_NAME} ${UNION_COMMIT_MAP}
+
+    PUSH_REFS="${SYNC_BRANCH_NAME} +$(map_ref ${SYNC_BRANCH_NAME}):$(map_ref ${SYNC_BRANCH_NAME})"
+    if [ "${VENDOR_SUBMODULES}" = "1" ]; then
+        run_stage ${SYNC_BRANCH_NAME} libs \
+            vendor_submodules "${ESP_IDF_BRANCH}" ${SYNC_BRANCH_NAME} ${UPSTREAM_TIP} "${@:3}"
+        if git rev-parse --verify --quiet refs/heads/$(libs_branch ${SYNC_BRANCH_NAME}); then
+            PUSH_REFS+=" $(libs_branch ${SYNC_BRANCH_NAME})"
+        fi
+    fi
 
-    git checkout -B ${SYNC_BRANCH_NAME}
-    git push ${ESP_HAL_3RDPARTY_URL} ${SYNC_BRANCH_NAME}
-    git clean -xdff
+    # Only a rewrite of the IDF history by filter-repo has a state to publish.
+    # Otherwise (filter engine, union history) the published one describes an
+    # older rewrite and is deleted, so that the next incremental run starts over.
+    if git rev-parse --verify --quiet refs/heads/${STATE_BRANCH}; then
+        PUSH_REFS+=" +refs/heads/${STATE_BRANCH}:$(state_ref ${SYNC_BRANCH_NAME})"
+    else
+        PUSH_REFS+=" :$(state_ref ${SYNC_BRANCH_NAME})"
+    fi
+    run_stage ${SYNC_BRANCH_NAME} push push_sync ${SYNC_BRANCH_NAME} ${UPSTREAM_TIP} ${PUSH_REFS}
+    push_sync_record "${SYNC_BRANCH_NAME}" "${UPSTREAM_TIP}" "${@:3}"
+    if [ -n "${SYNC_BUNDLE_DIR}" ]; then
+        run_stage ${SYNC_BRANCH_NAME} bundle write_bundles ${SYNC_BRANCH_NAME}
+    fi
     popd
+    run_stage ${SYNC_BRANCH_NAME} clean remove_workspace ${FOLDER_NAME}
+}
+
+# PIDs of the running sync jobs, by sync branch name
+declare -A SYNC_PIDS
+
+# Number of sync definitions of each IDF branch which are not done yet
+declare -A IDF_USERS
+
+# Remove the IDF clone and the union history of a branch once no sync
+# definition needs them anymore
+# Usage: release_idf ESP_IDF_BRANCH
+release_idf() {
+    IDF_USERS[$1]=$((IDF_USERS[$1] - 1))
+    if [ ${IDF_USERS[$1]} -le 0 ] && [ "${KEEP_WORKSPACES}" != "1" ]; then
+        rm -rf $(idf_source_dir "$1") $(union_dir "$1")
+        unset IDF_CLONED[$1]
+    fi
+}
+
+# Wait for running sync jobs until the disk usage is within SYNC_DISK_BUDGET
+# Usage: enforce_disk_budget
+enforce_disk_budget() {
+    [ "${SYNC_DISK_BUDGET}" -gt 0 ] || return 0
+
+    while [ $(disk_usage) -gt ${SYNC_DISK_BUDGET} ]
+    do
+        if [ $(jobs -rp | wc -l) -eq 0 ]; then
+            die "Disk usage of $(disk_usage) MiB is over SYNC_DISK_BUDGET (${SYNC_DISK_BUDGET} MiB)"
+        fi
+        echo "Disk usage over SYNC_DISK_BUDGET, waiting for a running sync"
+        wait -n || true
+    done
+}
+
+# Garbage collect the repositories shared by the runs, once nothing borrows
+# their objects anymore
+# Usage: gc_shared_stores
+gc_shared_stores() {
+    for STORE in ${IDF_MIRROR_DIR} ${SYNC_CHECK_DIR}
+    do
+        if [ -d "${STORE}" ]; then
+            git --git-dir="${STORE}" -c gc.autoDetach=false gc --auto
+        fi
+    done
+    stage_metric disk_mib $(disk_usage)
+}
+
+# Usage: queue_sync ESP_IDF_BRANCH SYNC_BRANCH_NAME ARGS...
+queue_sync() {
+    enforce_disk_budget
+
+    # Clone before starting the job, so that concurrent jobs only read the clone
+    clone_idf "$1"
+
+    # It can fetch blobs into the clone too. Only a report, which doesn't stop
+    # the sync when it fails: the failure is warned about, and its status
+    # recorded in the metrics of the stage.
+    if [ "${DEPS_CHECK}" = "1" ]; then
+        run_stage $2${DEBUG_SUFFIX} deps python3 ${SCRIPT_DIR}/component_deps.py \
+            --git-dir $(idf_source_dir "$1") --rev "refs/heads/$1" "$2" ||
+            echo "WARNING: dependency report of $2 failed with status $?"
+    fi
+
+    if [ "${SYNC_JOBS}" -le 1 ]; then
+        extract_components "$@"
+        release_idf "$1"
+        return
+    fi
+
+    while [ $(jobs -rp | wc -l) -ge ${SYNC_JOBS} ]; do
+        # The exit status is collected later by wait_syncs
+        wait -n || true
+    done
+
+    mkdir -p ${SYNC_LOG_DIR}
+    extract_components "$@" > ${SYNC_LOG_DIR}/$2.log 2>&1 &
+    SYNC_PIDS[$2]=$!
+}
+
+# Usage: wait_syncs
+wait_syncs() {
+    FAILED=""
+    for SYNC in "${!SYNC_PIDS[@]}"
+    do
+        if wait ${SYNC_PIDS[$SYNC]}; then
+            echo "Sync ${SYNC} done"
+        else
+            echo "Sync ${SYNC} failed, last lines of ${SYNC_LOG_DIR}/${SYNC}.log:"
+            tail -n 50 ${SYNC_LOG_DIR}/${SYNC}.log
+            FAILED+="${SYNC} "
+        fi
+        release_idf "${SYNC_IDF_BRANCH[$SYNC]}"
+    done
+
+    [ -z "${FAILED}" ] || die "Failed syncs: ${FAILED}"
+}
+
+# Sync definitions in order, with their IDF branch and quoted filter-repo arguments
+SYNC_DEFS=()
+declare -A SYNC_IDF_BRANCH
+declare -A SYNC_ARGS
+
+# Usage: add_sync ESP_IDF_BRANCH SYNC_BRANCH_NAME ARGS...
+add_sync() {
+    if [ -n "${SYNC_ONLY}" ] && [[ " ${SYNC_ONLY} " != *" $2 "* ]]; then
+        return
+    fi
+
+    SYNC_DEFS+=("$2")
+    SYNC_IDF_BRANCH[$2]=$1
+    SYNC_ARGS[$2]=$(printf '%q ' "${@:3}")
+}
+
+# Print the union of the paths synced from an IDF branch
+# Usage: branch_paths ESP_IDF_BRANCH
+branch_paths() {
+    for SYNC in "${SYNC_DEFS[@]}"
+    do
+        if [ "${SYNC_IDF_BRANCH[$SYNC]}" = "$1" ]; then
+            eval "path_prefixes ${SYNC_ARGS[$SYNC]}"
+        fi
+    done | sort -u
+}
+
+# Filter the union of the sync definitions of an IDF branch. All of them must
+# share the same options besides the paths.
+# Usage: prepare_union ESP_IDF_BRANCH
+prepare_union() {
+    OPTIONS=""
+    OPTIONS_OF=""
+
+    for SYNC in "${SYNC_DEFS[@]}"
+    do
+        [ "${SYNC_IDF_BRANCH[$SYNC]}" = "$1" ] || continue
+
+        eval "SYNC_ARGV=(${SYNC_ARGS[$SYNC]})"
+        SYNC_OPTIONS=()
+        for ((i = 0; i < ${#SYNC_ARGV[@]}; i++))
+        do
+            if [ "${SYNC_ARGV[$i]}" = "--path" ] || [ "${SYNC_ARGV[$i]}" = "--path-regex" ]; then
+                i=$((i + 1))
+            else
+                SYNC_OPTIONS+=("${SYNC_ARGV[$i]}")
+            fi
+        done
+
+        if [ -z "${OPTIONS_OF}" ]; then
+            OPTIONS=$(printf '%q ' "${SYNC_OPTIONS[@]}")
+            OPTIONS_OF=${SYNC}
+        elif [ "$(printf '%q ' "${SYNC_OPTIONS[@]}")" != "${OPTIONS}" ]; then
+            die "${SYNC} and ${OPTIONS_OF} use different filter options, can't filter their union"
+        fi
+    done
+
+    UNION_ARGS=$(branch_paths "$1" | sed 's/^/--path /' | tr '\n' ' ')
+
+    eval "filter_union \"\$1\" ${UNION_ARGS} ${OPTIONS}"
+}
+
+# Usage: run_syncs
+run_syncs() {
+    if [ -n "${IDF_PUSH_AFTER}" ]; then
+        echo "Triggered by the IDF push ${IDF_PUSH_BEFORE}..${IDF_PUSH_AFTER}"
+    fi
+
+    # A verification rebuilds every definition, and must not record anything
+    if [ "${SKIP_UNCHANGED}" = "1" ] && [ "${VERIFY}" != "1" ]; then
+        CHANGED_DEFS=()
+        for SYNC in "${SYNC_DEFS[@]}"
+        do
+            if eval "sync_is_current \"\${SYNC_IDF_BRANCH[\$SYNC]}\" \"\${SYNC}\${DEBUG_SUFFIX}\" ${SYNC_ARGS[$SYNC]}"; then
+                echo "Skipping ${SYNC}, its paths did not change upstream"
+            else
+                CHANGED_DEFS+=("${SYNC}")
+            fi
+        done
+        SYNC_DEFS=("${CHANGED_DEFS[@]}")
+    fi
+
+    for SYNC in "${SYNC_DEFS[@]}"
+    do
+        IDF_USERS[${SYNC_IDF_BRANCH[$SYNC]}]=$((IDF_USERS[${SYNC_IDF_BRANCH[$SYNC]}] + 1))
+    done
+
+    if [ "${UNION_FILTER}" = "1" ]; then
+        for ESP_IDF_BRANCH in $(for SYNC in "${SYNC_DEFS[@]}"; do echo "${SYNC_IDF_BRANCH[$SYNC]}"; done | sort -u)
+        do
+            clone_idf "${ESP_IDF_BRANCH}"
+            prepare_union "${ESP_IDF_BRANCH}"
+        done
+    fi
+
+    for SYNC in "${SYNC_DEFS[@]}"
+    do
+        eval "queue_sync \"\${SYNC_IDF_BRANCH[\$SYNC]}\" \"\$SYNC\" ${SYNC_ARGS[$SYNC]}"
+    done
+
+    wait_syncs
+    run_stage all gc gc_shared_stores
+
+    if [ "${OPTIMIZE_REMOTE}" = "1" ] && [ "${VERIFY}" != "1" ]; then
+        run_stage all optimize optimize_remote
+    fi
 }
 
 # Usage get_arg_by_components [COMPONENTS...]
@@ -67,81 +1285,61 @@ get_arg_by_components() {
     echo ${RET}
 }
 
+# Chip directory names of IDF, pruned from the components of a sync definition
+# limited to some chips
+IDF_TARGETS="esp32 esp32s2 esp32s3 esp32c2 esp32c3 esp32c5 esp32c6 esp32h2 esp32p4"
+
+# Print, one per line, --path-regex arguments keeping the components without
+# any directory named after a chip which is not in CHIPS
+# Usage: get_chip_args_by_components CHIPS [COMPONENTS...]
+get_chip_args_by_components() {
+    PRUNED=""
+    for TARGET in ${IDF_TARGETS}
+    do
+        if [[ " $1 " != *" ${TARGET} "* ]]; then
+            PRUNED+="${PRUNED:+|}${TARGET}"
+        fi
+    done
+
+    for COMPONENT in "${@:2}"
+    do
+        printf '%s\n' --path-regex "^components/${COMPONENT}/(?!(?:.*/)?(?:${PRUNED})(?:/|$))"
+    done
+}
+
 LIC_ARG="--path LICENSE"
 
-# The commits have the same SHA as long as the commit author, date, message and change list are the same.
-# Any modification to the strategy will create new branch that cannot be merged (pushed) to the existing one.
-
-MSG_CALLBACK="
-        # (https)?github.com/[user]/[proj]/*/[id] -> [Github: [user]/proj]/*/[id]
-        msg1 = re.sub(br'(?:(?:https?://)?github\.com/)([^\s/]+/[^\s/]+)/([^/]+/[0-9]+)', br'[Github: \1]/\2', message)
-
-        # espressif/esp-idf -> [ESP_IDF] (except from [Github: espressif/esp-idf])
-        return re.sub(br'espressif/esp-idf([^\]])', br'[ESP_IDF]\1', msg1)
-    "
-
-ARG=$(cat << EOF
-      ${LIC_ARG} $(get_arg_by_components \
-                   bootloader_support \
-                   efuse \
-                   esp_app_format \
-                   esp_common \
-                   esp_event \
-                   esp_hw_support \
-                   esp_phy \
-                   esp_rom \
-                   esp_system \
-                   esp_timer \
-                   esp_wifi \
-                   hal \
-                   log \
-                   mbedtls \
-                   newlib \
-                   riscv \
-                   soc \
-                   spi_flash \
-                   wpa_supplicant\
-                   xtensa \
-                   )
-EOF
-)
+# Usage: add_manifest_sync ESP_IDF_BRANCH SYNC_BRANCH_NAME MSG_CALLBACK COMPONENTS...
+add_manifest_sync() {
+    CHIPS=""
+    COMPONENTS=()
+    for COMPONENT in "${@:4}"
+    do
+        if [ "${COMPONENT#chip:}" != "${COMPONENT}" ]; then
+            [[ " ${IDF_TARGETS} " = *" ${COMPONENT#chip:} "* ]] || die "$2: unknown chip ${COMPONENT#chip:}"
+            CHIPS+="${COMPONENT#chip:} "
+        else
+            COMPONENTS+=("${COMPONENT}")
+        fi
+    done
 
-extract_components "release/v5.1" "sync-1-release_v5.1" ${ARG} --message-callback "${MSG_CALLBACK}"
-
-ARG=$(cat << EOF
-      ${LIC_ARG} $(get_arg_by_components \
-                   bootloader_support \
-                   bt \
-                   efuse \
-                   esp_app_format \
-                   esp_common \
-                   esp_event \
-                   esp_hw_support \
-                   esp_phy \
-                   esp_rom \
-                   esp_system \
-                   esp_timer \
-                   esp_wifi \
-                   hal \
-                   log \
-                   mbedtls \
-                   newlib \
-                   riscv \
-                   soc \
-                   spi_flash \
-                   wpa_supplicant\
-                   xtensa \
-                   )
-EOF
-)
+    if [ -n "${CHIPS}" ]; then
+        mapfile -t COMPONENT_ARGS < <(get_chip_args_by_components "${CHIPS}" "${COMPONENTS[@]}")
+    else
+        COMPONENT_ARGS=($(get_arg_by_components "${COMPONENTS[@]}"))
+    fi
 
-extract_components "release/v5.1" "sync-2-release_v5.1" ${ARG} --message-callback "${MSG_CALLBACK}"
+    # Message rules are applied by filter-repo without running Python code for
+    # each commit, the callback is only used when there are none
+    if [ -f "$(msg_rules_file "$3")" ]; then
+        MSG_ARGS=(--replace-message "$(msg_rules_file "$3")")
+    else
+        MSG_ARGS=(--message-callback "$(cat $(msg_callback_file "$3"))")
+    fi
 
-# Add new one here if you have new requirement
+    add_sync "$1" "$2" ${LIC_ARG} "${COMPONENT_ARGS[@]}" "${MSG_ARGS[@]}"
+}
 
-# Push to protected branch will cause that branch to appear on Github.
-# Try with non-protected branch first.
-# ARG="${LIC_ARG} $(get_arg_by_components esp_event esp_phy esp_wifi mbedtls wpa_supplicant)"
-# extract_components "release/v5.0" "test-sync-1-release_v5.0" ${ARG} --message-callback "${MSG_CALLBACK}"
+read_manifest add_manifest_sync
 
-############## Deprecated Syncs ###################
+run_syncs
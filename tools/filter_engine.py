@@ -0,0 +1,667 @@
+#!/usr/bin/env python3
+"""
+Rewrite the branches of the current repository like git filter-repo does with
+the options of the sync definitions, --path, --path-regex, --replace-message
+and --message-callback, without exporting every file change of the history:
+
+    filter_engine.py --jobs 8 --cache-dir filter_cache \\
+        --path LICENSE --path components/soc --message-callback "$(cat cb.py)"
+
+The filtered tree of a commit is built from its original tree, and the filtered
+version of each subtree is memoized by path and object ID: the directories a
+commit doesn't change are not looked at again, and the directories kept whole
+are never read. The trees are filtered by --jobs processes, each with its own
+git cat-file, while the commits are rewritten in order and written by a single
+git fast-import. With --cache-dir, the memo of a path selection is kept between
+runs.
+
+The commits are the ones filter-repo makes: the same trees, the commits which
+become empty and the merges which become degenerate pruned the same way, the
+commit IDs of the messages translated before the message rules and callback,
+and the signatures dropped. Every commit ID is computed before fast-import writes it,
+and checked against what it wrote before any ref is updated. The commit map is
+written to filter-repo/commit-map, with pruned commits mapped to zeros.
+
+Branches are the only rewritten refs, tags are deleted. Unlike filter-repo,
+this engine doesn't keep a state branch for incremental runs (--state-branch is
+accepted and ignored), nor rewrites a part of the history (--refs). It exits
+with status 3, before updating anything, on commits it can't rewrite the same
+way, like commits with an encoding header.
+"""
+
+import argparse
+import hashlib
+import multiprocessing
+import os
+import pickle
+import re
+import subprocess
+import sys
+from functools import lru_cache
+
+NULL_SHA = b'0' * 40
+EMPTY_TREE = b'4b825dc642cb6eb9a060e54bf8d69288fbee4904'
+DIR_MODE = b'40000'
+FILE_MODES = (b'100644', b'100755', b'120000', b'160000')
+SCRATCH_REF = b'refs/filter-engine/scratch'
+
+# Same as filter-repo, for the commit IDs to translate in messages
+HASH_RE = re.compile(br'(\b[0-9a-f]{7,40}\b)')
+
+# Status of a directory for a path selection
+ALL, SOME, NONE = range(3)
+
+# Exit status when the history needs filter-repo
+UNSUPPORTED = 3
+
+
+class Unsupported(Exception):
+    pass
+
+
+def hex_oid(oid):
+    """Hexadecimal object ID of a tree, EMPTY_TREE for None"""
+    return oid.hex().encode() if oid is not None else EMPTY_TREE
+
+
+def is_dir(entry):
+    return entry is not None and entry[0] == DIR_MODE
+
+
+def quote(path):
+    """fast-import path, C-style quoted when it could not be read back as is"""
+    if not path.startswith(b'"') and b'\n' not in path:
+        return path
+    return b'"' + path.replace(b'\\', b'\\\\').replace(b'"', b'\\"').replace(b'\n', b'\\n') + b'"'
+
+
+def join(path, name):
+    return path + b'/' + name if path else name
+
+
+def parse_tree(data):
+    """Entries of a tree object, as (mode, name, raw object ID)"""
+    entries = []
+    pos = 0
+    while pos < len(data):
+        space = data.index(b' ', pos)
+        nul = data.index(b'\0', space)
+        entries.append((data[pos:space], data[space + 1:nul], data[nul + 1:nul + 21]))
+        pos = nul + 21
+    return entries
+
+
+def tree_oid(entries):
+    body = b''.join(mode + b' ' + name + b'\0' + oid for mode, name, oid in entries)
+    return hashlib.sha1(b'tree %d\0' % len(body) + body).digest()
+
+
+def file_mode(mode):
+    """Mode of a file as fast-export writes it"""
+    if mode in FILE_MODES:
+        return mode
+    return b'100755' if int(mode, 8) & 0o111 else b'100644'
+
+
+class Commit:
+    __slots__ = ('oid', 'tree', 'parents', 'author', 'committer', 'message', 'filtered')
+
+    def __init__(self, oid, data):
+        header, _, self.message = data.partition(b'\n\n')
+        self.oid = oid
+        self.parents = []
+        for line in header.split(b'\n'):
+            key, _, value = line.partition(b' ')
+            if key == b'tree':
+                self.tree = value
+            elif key == b'parent':
+                self.parents.append(value)
+            elif key == b'author':
+                self.author = value
+            elif key == b'committer':
+                self.committer = value
+            elif key == b'encoding':
+                raise Unsupported('{} has an encoding header'.format(oid.decode()))
+        self.filtered = None
+
+
+class ObjectReader:
+    """Objects of the repository, read through one git cat-file --batch"""
+
+    def __init__(self):
+        self.process = subprocess.Popen(['git', 'cat-file', '--batch'],
+                                        stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def read(self, oid):
+        self.process.stdin.write(oid + b'\n')
+        self.process.stdin.flush()
+        header = self.process.stdout.readline().split()
+        if header[1] == b'missing':
+            raise Unsupported('{} is missing'.format(oid.decode()))
+        data = self.process.stdout.read(int(header[2]))
+        self.process.stdout.read(1)
+        return data
+
+
+class Selection:
+    """Paths kept by --path and --path-regex, matched like filter-repo does"""
+
+    def __init__(self, paths, regexes):
+        self.paths = [p.encode() for p in paths]
+        self.dirs = [p if p.endswith(b'/') else p + b'/' for p in self.paths]
+        self.regexes = [re.compile(r.encode()) for r in regexes]
+        self.prefixes = [self.literal_prefix(r.encode()) for r in regexes]
+        self.key = hashlib.sha1(repr((sorted(paths), sorted(regexes))).encode()).hexdigest()
+
+    @staticmethod
+    def literal_prefix(regex):
+        """What every path matched by an anchored regex starts with, None when
+        the regex is not anchored"""
+        if not regex.startswith(b'^') or b'|' in re.sub(br'\\.|\[[^]]*\]|\((?:[^()]|\\.)*\)', b'', regex):
+            return None
+        prefix = re.match(br'[^][(){}.*+?|\\^$]*', regex[1:]).group(0)
+        if regex[1 + len(prefix):2 + len(prefix)] in (b'*', b'?', b'{'):
+            prefix = prefix[:-1]
+        return prefix
+
+    @lru_cache(maxsize=None)
+    def keeps(self, path):
+        for p in self.paths:
+            if path.startswith(p) and (p.endswith(b'/') or len(path) == len(p) or
+                                       path[len(p):len(p) + 1] == b'/'):
+                return True
+        return any(r.search(path) for r in self.regexes)
+
+    @lru_cache(maxsize=None)
+    def directory(self, path):
+        path += b'/'
+        if any(path.startswith(d) for d in self.dirs):
+            return ALL
+        if any(d.startswith(path) for d in self.dirs):
+            return SOME
+        for prefix in self.prefixes:
+            if prefix is None or path.startswith(prefix) or prefix.startswith(path):
+                return SOME
+        return NONE
+
+
+class TreeFilter:
+    """Filtered trees of a selection, memoized by path and source tree"""
+
+    def __init__(self, selection, reader, memo=None):
+        self.selection = selection
+        self.reader = reader
+        # (path, source tree) -> filtered tree, None when empty
+        self.memo = memo if memo is not None else {}
+        # Entries of the filtered trees which are not source trees
+        self.trees = {}
+        self.added = {}
+
+    def filter(self, path, oid):
+        key = (path, oid)
+        if key in self.memo:
+            return self.memo[key]
+
+        entries = parse_tree(self.reader.read(oid.hex().encode()))
+        kept = []
+        for mode, name, child in entries:
+            child_path = join(path, name)
+            if mode == DIR_MODE:
+                status = self.selection.directory(child_path)
+                if status == SOME:
+                    child = self.filter(child_path, child)
+                if status != NONE and child is not None:
+                    kept.append((mode, name, child))
+            elif self.selection.keeps(child_path):
+                kept.append((file_mode(mode), name, child))
+
+        if not kept:
+            result = None
+        elif kept == entries:
+            result = oid
+        else:
+            result = tree_oid(kept)
+            self.trees[result] = kept
+        self.memo[key] = result
+        self.added[key] = result
+        return result
+
+    def take_added(self):
+        """Memo entries and trees made since the last call"""
+        added, trees = self.added, self.trees
+        self.added, self.trees = {}, {}
+        return added, trees
+
+
+# Filter of each worker process
+WORKER = None
+
+
+def init_worker(selection, cache_file):
+    global WORKER
+    WORKER = TreeFilter(selection, ObjectReader(), load_cache(cache_file)[0])
+
+
+def filter_commits(oids):
+    """Parse and filter the trees of some commits, in a worker process"""
+    try:
+        commits = [Commit(oid, WORKER.reader.read(oid)) for oid in oids]
+        for commit in commits:
+            commit.filtered = WORKER.filter(b'', bytes.fromhex(commit.tree.decode()))
+    except Unsupported as error:
+        return error
+    return (commits,) + WORKER.take_added()
+
+
+def load_cache(cache_file):
+    """Memo and trees of a path selection kept by a previous run"""
+    if cache_file and os.path.exists(cache_file):
+        with open(cache_file, 'rb') as cache:
+            return pickle.load(cache)
+    return {}, {}
+
+
+def save_cache(cache_file, memo, trees):
+    os.makedirs(os.path.dirname(cache_file), exist_ok=True)
+    with open(cache_file + '.tmp', 'wb') as cache:
+        pickle.dump((memo, trees), cache, pickle.HIGHEST_PROTOCOL)
+    os.replace(cache_file + '.tmp', cache_file)
+
+
+class MessageRules:
+    """Replacements of a filter-repo --replace-message file, one per line: a
+    literal text, or a regex: pattern, with ==> and what replaces it
+    (***REMOVED*** by default). The literals apply first, then the patterns,
+    each in turn on the result of the previous one."""
+
+    def __init__(self, path):
+        self.literals = []
+        self.regexes = []
+        with open(path, 'rb') as rules:
+            for line in rules:
+                line = line.rstrip(b'\r\n')
+                replacement = b'***REMOVED***'
+                if b'==>' in line:
+                    line, replacement = line.rsplit(b'==>', 1)
+                if line.startswith(b'regex:'):
+                    self.regexes.append((re.compile(line[6:]), replacement))
+                elif line.startswith(b'glob:'):
+                    raise Unsupported('glob: rules of {}'.format(path))
+                else:
+                    if line.startswith(b'literal:'):
+                        line = line[8:]
+                    if line:
+                        self.literals.append((line, replacement))
+
+        # A message no rule matches is left as it is, which a single search of
+        # every pattern at once tells. Patterns with backreferences can't be
+        # combined, their groups would be renumbered.
+        patterns = [re.escape(literal) for literal, _ in self.literals]
+        patterns += [regex.pattern for regex, _ in self.regexes]
+        self.any_rule = None
+        if patterns and not any(re.search(br'\\[1-9]|\(\?P=', p) for p in patterns):
+            try:
+                self.any_rule = re.compile(b'|'.join(b'(?:%s)' % p for p in patterns))
+            except re.error:
+                pass
+
+    def apply(self, message):
+        if self.any_rule is not None and not self.any_rule.search(message):
+            return message
+        for literal, replacement in self.literals:
+            message = message.replace(literal, replacement)
+        for regex, replacement in self.regexes:
+            message = regex.sub(replacement, message)
+        return message
+
+
+def make_callback(code):
+    """Message callback compiled the way filter-repo does"""
+    exec('def callback(message, _do_not_use_this_var = None):\n' +
+         '  ' + '\n  '.join(code.splitlines()), globals())
+    return globals()['callback']
+
+
+class Rewriter:
+    """Rewrite the filtered commits in order, into a git fast-import"""
+
+    def __init__(self, trees, rules, callback, marks_file):
+        self.reader = ObjectReader()
+        self.trees = trees
+        self.rules = rules
+        self.callback = callback
+        self.marks_file = marks_file
+        self.importer = subprocess.Popen(['git', 'fast-import', '--quiet', '--force',
+                                          '--export-marks=' + marks_file],
+                                         stdin=subprocess.PIPE)
+        self.output = self.importer.stdin
+        self.output.write(b'feature done\n')
+
+        # Source commit -> its source tree and its filtered tree
+        self.source_trees = {}
+        self.filtered = {}
+        # Source commit -> rewritten commit, None when pruned
+        self.renames = {}
+        # Source commit -> what its children get as parent: the rewritten
+        # commit, or for a pruned one what it was rewritten to
+        self.parent_of = {}
+        self.skipped = set()
+        self.short_hashes = {}
+        # Rewritten commit -> tree, parents, generation, fast-import mark
+        self.new_trees = {}
+        self.graph = {}
+        self.generation = {}
+        self.marks = {}
+
+    @lru_cache(maxsize=65536)
+    def source_entries(self, oid):
+        return parse_tree(self.reader.read(oid.hex().encode()))
+
+    def entries(self, oid):
+        """Entries of a tree as a dict, by name"""
+        if oid is None:
+            return {}
+        entries = self.trees[oid] if oid in self.trees else self.source_entries(oid)
+        return {name: (mode, child) for mode, name, child in entries}
+
+    def make_tree(self, entries):
+        if not entries:
+            return None
+        # git sorts directories as if their name ended with a slash
+        kept = sorted(((mode, name, oid) for name, (mode, oid) in entries.items()),
+                      key=lambda e: e[1] + b'/' if e[0] == DIR_MODE else e[1])
+        oid = tree_oid(kept)
+        self.trees.setdefault(oid, kept)
+        return oid
+
+    def patch(self, tree, old, new):
+        """TREE with the file changes from OLD to NEW applied, as fast-import
+        applies the file changes exported against the original first parent"""
+        if old == new:
+            return tree
+        if tree == old:
+            return new
+        current, before, after = self.entries(tree), self.entries(old), self.entries(new)
+        result = dict(current)
+        for name in before.keys() | after.keys():
+            was, now = before.get(name), after.get(name)
+            if was == now:
+                continue
+            if (was is None or is_dir(was)) and (now is None or is_dir(now)):
+                here = current.get(name)
+                if here is not None and not is_dir(here):
+                    # Deletions under a file don't touch it, additions replace it
+                    sub = self.patch(None, was and was[1], now and now[1])
+                    if sub is None:
+                        continue
+                else:
+                    sub = self.patch(here and here[1], was and was[1], now and now[1])
+                if sub is None:
+                    result.pop(name, None)
+                else:
+                    result[name] = (DIR_MODE, sub)
+            elif now is None:
+                result.pop(name, None)
+            else:
+                result[name] = now
+        return self.make_tree(result)
+
+    def write_changes(self, path, old, new):
+        """fast-import file changes turning the tree OLD into NEW"""
+        before, after = self.entries(old), self.entries(new)
+        for name in sorted(before.keys() | after.keys()):
+            was, now = before.get(name), after.get(name)
+            if was == now:
+                continue
+            child_path = join(path, name)
+            if now is None:
+                self.output.write(b'D %s\n' % quote(child_path))
+            elif not is_dir(now):
+                self.output.write(b'M %s %s %s\n' % (now[0], now[1].hex().encode(), quote(child_path)))
+            elif is_dir(was):
+                self.write_changes(child_path, was[1], now[1])
+            elif now[1] not in self.trees:
+                # A source tree, which fast-import reads from the repository
+                self.output.write(b'M 040000 %s %s\n' % (now[1].hex().encode(), quote(child_path)))
+            else:
+                if was is not None:
+                    self.output.write(b'D %s\n' % quote(child_path))
+                self.write_changes(child_path, None, now[1])
+
+    def is_ancestor(self, ancestor, commit):
+        """Whether a rewritten commit is an ancestor of another"""
+        floor = self.generation[ancestor]
+        seen = set()
+        pending = [commit]
+        while pending:
+            current = pending.pop()
+            if current == ancestor:
+                return True
+            for parent in self.graph[current]:
+                if parent not in seen and self.generation[parent] >= floor:
+                    seen.add(parent)
+                    pending.append(parent)
+        return False
+
+    def trim_parents(self, parents, source_parents):
+        """Parents left once the pruned ones and the redundant rewritten ones are
+        removed, and the new first parent when the first one was removed"""
+        kept = [(new, source in self.skipped)
+                for new, source in zip(parents, source_parents) if new is not None]
+        parents = [new for new, _ in kept]
+        rewritten = [was_skipped for _, was_skipped in kept]
+        if len(parents) < 2:
+            return parents, None
+
+        redundant = []
+        for cur in range(len(parents)):
+            if not rewritten[cur]:
+                continue
+            for other in range(len(parents)):
+                if cur != other and other not in redundant and parents[cur] == parents[other]:
+                    redundant.append(cur)
+                    break
+        for cur in range(len(parents)):
+            if not rewritten[cur]:
+                continue
+            for other in range(len(parents)):
+                if cur != other and other not in redundant and \
+                        self.is_ancestor(parents[cur], parents[other]):
+                    redundant.append(cur)
+                    break
+
+        if not redundant:
+            return parents, None
+        remaining = [new for i, new in enumerate(parents) if i not in redundant]
+        return remaining, remaining[0] if 0 in redundant else None
+
+    def prunable(self, commit, parents, new_first_parent, tree):
+        """Same decision as filter-repo's default --prune-empty and
+        --prune-degenerate, for commits without blob rewriting"""
+        source_first = commit.parents[0] if commit.parents else None
+        had_changes = commit.tree != (self.source_trees[source_first] if source_first else EMPTY_TREE)
+        has_changes = commit.filtered != (self.filtered[source_first] if source_first else None)
+
+        if len(parents) >= 2 and not new_first_parent:
+            return False
+        if len(parents) < 2:
+            if not had_changes:
+                return len(parents) < len(commit.parents) or (
+                    len(commit.parents) == 1 and source_first in self.skipped)
+            if not has_changes:
+                return True
+        if not parents or len(commit.parents) < 2:
+            return False
+        # A merge whose changes are already in its new first parent
+        return tree == self.new_trees[new_first_parent or parents[0]]
+
+    def translate_hash(self, match):
+        old = match.group(1)
+        new = self.renames.get(old)
+        if new is None:
+            matches = [oid for oid in self.short_hashes.get(old[:7], ()) if oid.startswith(old)]
+            if len(matches) != 1 or self.renames[matches[0]] is None:
+                return old
+            new = self.renames[matches[0]]
+        return new[:len(old)]
+
+    def rewrite(self, commit):
+        self.source_trees[commit.oid] = commit.tree
+        self.filtered[commit.oid] = commit.filtered
+        self.short_hashes.setdefault(commit.oid[:7], []).append(commit.oid)
+
+        parents, new_first_parent = self.trim_parents(
+            [self.parent_of[p] for p in commit.parents], commit.parents)
+        source_base = self.filtered[commit.parents[0]] if commit.parents else None
+        base = self.new_trees[parents[0]] if parents else None
+        tree = self.patch(base, source_base, commit.filtered)
+
+        if self.prunable(commit, parents, new_first_parent, tree):
+            self.renames[commit.oid] = None
+            self.parent_of[commit.oid] = new_first_parent or (parents[0] if parents else None)
+            self.skipped.add(commit.oid)
+            return
+
+        message = HASH_RE.sub(self.translate_hash, commit.message)
+        if self.rules:
+            message = self.rules.apply(message)
+        if self.callback:
+            message = self.callback(message)
+
+        body = b'tree %s\n' % hex_oid(tree)
+        body += b''.join(b'parent %s\n' % p for p in parents)
+        body += b'author %s\ncommitter %s\n\n' % (commit.author, commit.committer) + message
+        oid = hashlib.sha1(b'commit %d\0' % len(body) + body).hexdigest().encode()
+
+        mark = len(self.marks) + 1
+        if not parents:
+            self.output.write(b'reset %s\n\n' % SCRATCH_REF)
+        self.output.write(b'commit %s\nmark :%d\n' % (SCRATCH_REF, mark))
+        self.output.write(b'author %s\ncommitter %s\ndata %d\n%s\n' %
+                          (commit.author, commit.committer, len(message), message))
+        for i, parent in enumerate(parents):
+            self.output.write(b'%s :%d\n' % (b'merge' if i else b'from', self.marks[parent]))
+        self.write_changes(b'', base, tree)
+        self.output.write(b'\n')
+
+        self.renames[commit.oid] = oid
+        self.parent_of[commit.oid] = oid
+        self.new_trees[oid] = tree
+        self.graph[oid] = parents
+        self.generation[oid] = 1 + max((self.generation[p] for p in parents), default=0)
+        self.marks[oid] = mark
+
+    def abort(self):
+        """Stop fast-import before it updates anything"""
+        self.importer.kill()
+        self.importer.wait()
+
+    def finish(self):
+        """Wait for fast-import and check that it wrote the expected commits"""
+        self.output.write(b'done\n')
+        self.output.close()
+        if self.importer.wait() != 0:
+            sys.exit('fast-import failed')
+        written = {}
+        with open(self.marks_file, 'rb') as marks:
+            for line in marks:
+                mark, oid = line.split()
+                written[int(mark[1:])] = oid
+        for oid, mark in self.marks.items():
+            if written.get(mark) != oid:
+                sys.exit('fast-import wrote {} instead of {}'.format(
+                    written.get(mark, b'nothing').decode(), oid.decode()))
+
+
+def git(*args):
+    return subprocess.check_output(('git',) + args)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--path', action='append', default=[], help='path to keep, as in filter-repo')
+    parser.add_argument('--path-regex', action='append', default=[],
+                        help='regular expression of the paths to keep, as in filter-repo')
+    parser.add_argument('--replace-message', help='file of message rules, as in filter-repo')
+    parser.add_argument('--message-callback', help='body of the message callback, as in filter-repo')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='tree filtering processes')
+    parser.add_argument('--cache-dir', help='where the memo of each path selection is kept')
+    parser.add_argument('--chunk', type=int, default=500, help='commits filtered per task')
+    parser.add_argument('--force', action='store_true', help='ignored, as histories are always rewritten')
+    parser.add_argument('--state-branch', help='ignored, no state is kept')
+    args = parser.parse_args()
+
+    if not args.path and not args.path_regex:
+        parser.error('no path selected')
+    selection = Selection(args.path, args.path_regex)
+    callback = make_callback(args.message_callback) if args.message_callback else None
+    try:
+        rules = MessageRules(args.replace_message) if args.replace_message else None
+    except Unsupported as error:
+        print('Not supported by the filter engine: {}'.format(error), file=sys.stderr)
+        sys.exit(UNSUPPORTED)
+    cache_file = os.path.join(args.cache_dir, selection.key + '.pickle') if args.cache_dir else None
+
+    git_dir = git('rev-parse', '--git-dir').strip().decode()
+    os.makedirs(os.path.join(git_dir, 'filter-repo'), exist_ok=True)
+
+    refs = [line.split() for line in git('for-each-ref', '--format=%(objectname) %(refname)',
+                                         'refs/heads', 'refs/tags').splitlines()]
+    branches = [(oid, ref) for oid, ref in refs if ref.startswith(b'refs/heads/')]
+    if not branches:
+        sys.exit('no branch to rewrite')
+    oids = git('rev-list', '--topo-order', '--reverse', *[oid.decode() for oid, _ in branches]).split()
+    chunks = [oids[i:i + args.chunk] for i in range(0, len(oids), args.chunk)]
+    print('Rewriting {} commits of {} with {} jobs'.format(
+        len(oids), ', '.join(ref.decode() for _, ref in branches), args.jobs), file=sys.stderr)
+
+    # The workers are forked first, not to hold the pipe of fast-import open
+    if args.jobs > 1:
+        pool = multiprocessing.Pool(args.jobs, init_worker, (selection, cache_file))
+        results = pool.imap(filter_commits, chunks)
+    else:
+        init_worker(selection, cache_file)
+        results = map(filter_commits, chunks)
+    memo, trees = load_cache(cache_file)
+    rewriter = Rewriter(dict(trees), rules, callback, os.path.join(git_dir, 'filter-repo', 'marks'))
+
+    try:
+        for result in results:
+            if isinstance(result, Unsupported):
+                raise result
+            commits, added, new_trees = result
+            memo.update(added)
+            trees.update(new_trees)
+            rewriter.trees.update(new_trees)
+            for commit in commits:
+                rewriter.rewrite(commit)
+    except Unsupported as error:
+        rewriter.abort()
+        print('Not supported by the filter engine: {}'.format(error), file=sys.stderr)
+        sys.exit(UNSUPPORTED)
+    finally:
+        if args.jobs > 1:
+            pool.terminate()
+    rewriter.finish()
+
+    updates = b''
+    for oid, ref in branches:
+        new = rewriter.parent_of[oid]
+        updates += b'update %s %s\n' % (ref, new) if new else b'delete %s\n' % ref
+    updates += b''.join(b'delete %s\n' % ref for _, ref in refs if ref.startswith(b'refs/tags/'))
+    updates += b'delete %s\n' % SCRATCH_REF
+    subprocess.run(['git', 'update-ref', '--stdin'], input=updates, check=True)
+
+    with open(os.path.join(git_dir, 'filter-repo', 'commit-map'), 'wb') as commit_map:
+        commit_map.write(b'old' + b' ' * 38 + b'new\n')
+        for old in oids:
+            commit_map.write(b'%s %s\n' % (old, rewriter.renames[old] or NULL_SHA))
+
+    if cache_file:
+        save_cache(cache_file, memo, trees)
+    print('Kept {} of {} commits'.format(len(rewriter.marks), len(oids)), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
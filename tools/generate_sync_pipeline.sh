@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Generate the child pipeline running one sync job per manifest definition.
+# When SYNC_IDF_BRANCHES is set (by tools/sync_trigger.py), only the definitions
+# of these space separated IDF branches get a job.
+# Usage: generate_sync_pipeline.sh > sync-pipeline.yml
+
+set -e
+
+source $(dirname $0)/sync_manifest.sh
+
+cat << 'EOF_TEMPLATE'
+stages:
+  - sync
+
+.sync_job:
+  image: $CI_DOCKER_REGISTRY/esp-env-v5.1:1
+  stage: sync
+  tags:
+    - build
+  variables:
+    IDF_URL: ${CI_IDF_URL}
+    ESP_HAL_3RDPARTY_URL: https://gitlab-ci-token:${CI_ESP_HAL_3RDPARTY_TOKEN}@${CI_SERVER_HOST}:${CI_SERVER_PORT}/${CI_PROJECT_PATH}.git
+    IDF_MIRROR_DIR: ${CI_PROJECT_DIR}/.cache/idf-mirror.git
+    SKIP_UNCHANGED: "1"
+    VENDOR_SUBMODULES: "1"
+    SYNC_METRICS: ${CI_PROJECT_DIR}/sync_metrics.jsonl
+  script:
+    - pip install git-filter-repo
+    - tools/extract_idf_components.sh
+  artifacts:
+    when: always
+    paths:
+      - sync_metrics.jsonl
+EOF_TEMPLATE
+
+# Usage: print_job ESP_IDF_BRANCH SYNC_BRANCH_NAME MSG_CALLBACK COMPONENTS...
+print_job() {
+    if [ -n "${SYNC_IDF_BRANCHES}" ] && [[ " ${SYNC_IDF_BRANCHES} " != *" $1 "* ]]; then
+        return
+    fi
+
+    cat << EOF_JOB
+
+sync:$2:
+  extends: .sync_job
+  variables:
+    SYNC_ONLY: $2
+  cache:
+    key: idf-mirror-${1//\//_}
+    paths:
+      - .cache/idf-mirror.git
+EOF_JOB
+}
+
+read_manifest print_job
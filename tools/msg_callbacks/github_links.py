@@ -0,0 +1,5 @@
+# (https)?github.com/[user]/[proj]/*/[id] -> [Github: [user]/proj]/*/[id]
+msg1 = re.sub(br'(?:(?:https?://)?github\.com/)([^\s/]+/[^\s/]+)/([^/]+/[0-9]+)', br'[Github: \1]/\2', message)
+
+# espressif/esp-idf -> [ESP_IDF] (except from [Github: espressif/esp-idf])
+return re.sub(br'espressif/esp-idf([^\]])', br'[ESP_IDF]\1', msg1)
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Repack a repository serving the sync branches for its clients: one delta
+# island per branch, so that the objects sent for a branch never need a delta
+# base from another one, reachability bitmaps and a commit-graph.
+#
+# Usage: optimize_repo.sh [GIT_DIR]
+#
+# PACK_WINDOW and PACK_DEPTH tune the delta search, as in extract_idf_components.sh.
+# On a hosted server, where the repository can't be reached, the same settings
+# belong to its housekeeping configuration.
+
+set -ex
+
+GIT_DIR=${1:-$(git rev-parse --git-dir)}
+PACK_WINDOW=${PACK_WINDOW:-250}
+PACK_DEPTH=${PACK_DEPTH:-50}
+
+# Every branch is its own island, named after it
+git --git-dir="${GIT_DIR}" config --replace-all pack.island 'refs/heads/(.*)'
+git --git-dir="${GIT_DIR}" config repack.writeBitmaps true
+git --git-dir="${GIT_DIR}" config pack.writeBitmapHashCache true
+git --git-dir="${GIT_DIR}" config core.commitGraph true
+
+git --git-dir="${GIT_DIR}" repack -a -d -f -i --window=${PACK_WINDOW} --depth=${PACK_DEPTH}
+git --git-dir="${GIT_DIR}" commit-graph write --reachable --changed-paths
+git --git-dir="${GIT_DIR}" count-objects -v -H
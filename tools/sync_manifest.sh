@@ -0,0 +1,28 @@
+# Reader of the sync manifest, sourced by the sync tools
+
+SCRIPT_DIR=$(cd $(dirname ${BASH_SOURCE[0]}) && pwd)
+SYNC_MANIFEST=${SYNC_MANIFEST:-${SCRIPT_DIR}/sync_manifest.txt}
+
+# Call HANDLER once per sync definition of the manifest, with the arguments
+# ESP_IDF_BRANCH SYNC_BRANCH_NAME MSG_CALLBACK COMPONENTS...
+# Usage: read_manifest HANDLER
+read_manifest() {
+    # No -r, so that a trailing '\' continues a definition on the next line
+    while read DEF_IDF_BRANCH DEF_SYNC_BRANCH DEF_MSG_CALLBACK DEF_COMPONENTS
+    do
+        if [ -z "${DEF_IDF_BRANCH}" ] || [ "${DEF_IDF_BRANCH:0:1}" = "#" ]; then
+            continue
+        fi
+        $1 "${DEF_IDF_BRANCH}" "${DEF_SYNC_BRANCH}" "${DEF_MSG_CALLBACK}" ${DEF_COMPONENTS}
+    done < "${SYNC_MANIFEST}"
+}
+
+# Usage: msg_callback_file MSG_CALLBACK
+msg_callback_file() {
+    echo "${SCRIPT_DIR}/msg_callbacks/$1.py"
+}
+
+# Usage: msg_rules_file MSG_CALLBACK
+msg_rules_file() {
+    echo "${SCRIPT_DIR}/msg_rules/$1.txt"
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Find the sync commit made from an IDF commit, or with -r the IDF commit a sync
+# commit was made from, in the index published as refs/sync-map/[sync branch].
+# COMMIT can be abbreviated. IDF commits which did not touch the synced paths
+# have no sync commit.
+#
+# Usage: sync_map_lookup.sh [-r] SYNC_BRANCH_NAME COMMIT
+#
+# Runs in any git repository, the index is fetched from ESP_HAL_3RDPARTY_URL
+# (origin by default).
+
+set -e
+
+export LC_ALL=C
+
+TABLE="upstream-to-sync"
+if [ "$1" = "-r" ]; then
+    TABLE="sync-to-upstream"
+    shift
+fi
+[ $# -eq 2 ] || { grep -m 1 '^# Usage:' $0 | cut -c3-; exit 2; }
+
+SYNC_BRANCH_NAME=$1
+COMMIT=$(echo $2 | tr 'A-F' 'a-f')
+ESP_HAL_3RDPARTY_URL=${ESP_HAL_3RDPARTY_URL:-origin}
+MAP_REF="refs/sync-map/${SYNC_BRANCH_NAME}"
+
+git fetch --quiet ${ESP_HAL_3RDPARTY_URL} "+${MAP_REF}:${MAP_REF}"
+
+INDEX=$(mktemp)
+trap "rm -f ${INDEX}" EXIT
+git cat-file blob "${MAP_REF}:${TABLE}" > ${INDEX}
+
+# Every line of the table has the same length
+ENTRY_SIZE=$(head -n 1 ${INDEX} | wc -c)
+[ ${ENTRY_SIZE} -gt 0 ] || { echo "Empty index" >&2; exit 1; }
+ENTRIES=$(($(stat -c %s ${INDEX}) / ENTRY_SIZE))
+
+# Usage: entry INDEX
+entry() {
+    dd if=${INDEX} bs=${ENTRY_SIZE} skip=$1 count=1 2> /dev/null
+}
+
+# First entry whose key is not lower than COMMIT
+LOW=0
+HIGH=${ENTRIES}
+while [ ${LOW} -lt ${HIGH} ]
+do
+    MID=$(((LOW + HIGH) / 2))
+    KEY=$(entry ${MID} | cut -d' ' -f1)
+    if [[ "${KEY}" < "${COMMIT}" ]]; then
+        LOW=$((MID + 1))
+    else
+        HIGH=${MID}
+    fi
+done
+
+MATCH=$(entry ${LOW})
+if [ ${LOW} -ge ${ENTRIES} ] || [[ "${MATCH}" != "${COMMIT}"* ]]; then
+    echo "${COMMIT} not found in ${TABLE} of ${SYNC_BRANCH_NAME}" >&2
+    exit 1
+fi
+if [ $((LOW + 1)) -lt ${ENTRIES} ] && [[ "$(entry $((LOW + 1)))" == "${COMMIT}"* ]] &&
+    [ "$(entry $((LOW + 1)) | cut -d' ' -f1)" != "$(echo ${MATCH} | cut -d' ' -f1)" ]; then
+    echo "${COMMIT} is ambiguous" >&2
+    exit 1
+fi
+
+echo ${MATCH} | cut -d' ' -f2
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""
+Receive the push events of IDF and start an incremental sync of the sync
+branches of each pushed IDF branch, either by triggering the CI pipeline:
+
+    sync_trigger.py --listen 0.0.0.0:8080 --secret S gitlab \\
+        --url https://gitlab.example.com --project 123 --token T --ref master
+
+or, as a local stand-in for testing offline, by running the sync script:
+
+    sync_trigger.py --listen 127.0.0.1:8080 local --work-dir sync_trigger_work
+
+The events are GitLab or GitHub push webhooks, or any JSON object with "ref",
+"before" and "after". They are coalesced per IDF branch: a sync starts --delay
+seconds after the first event and covers every push received meanwhile. Events
+received while it runs start a single other sync once it is done. The syncs
+run with INCREMENTAL=1 and SKIP_UNCHANGED=1, so a push which doesn't touch the
+synced paths costs no clone.
+
+With a file:// IDF_URL and a local ESP_HAL_3RDPARTY_URL in the environment of
+the local mode, the whole chain is tested with (--secret is optional in this
+mode only, the gitlab mode refuses to start without it):
+
+    curl -d '{"ref": "refs/heads/release/v5.1", "before": "...", "after": "..."}' \\
+        http://127.0.0.1:8080/
+"""
+
+import argparse
+import hashlib
+import hmac
+import http.server
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+import urllib.parse
+import urllib.request
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+NULL_SHA = '0' * 40
+
+
+def log(message):
+    print('{} {}'.format(time.strftime('%Y-%m-%d %H:%M:%S'), message), file=sys.stderr, flush=True)
+
+
+def manifest_syncs():
+    """Sync branch names of the manifest, by IDF branch"""
+    output = subprocess.check_output(
+        ['bash', '-c', 'source "$0/sync_manifest.sh"; print_def() { echo "$1 $2"; }; read_manifest print_def',
+         TOOLS_DIR], text=True)
+    syncs = {}
+    for line in output.splitlines():
+        idf_branch, sync_branch = line.split()
+        syncs.setdefault(idf_branch, []).append(sync_branch)
+    return syncs
+
+
+class Coalescer:
+    """Run at most one sync per IDF branch at a time, for all the pushes received
+    since the previous one started"""
+
+    def __init__(self, delay, start_sync):
+        self.delay = delay
+        self.start_sync = start_sync
+        self.lock = threading.Lock()
+        # IDF branch -> [first before, last after] of the pushes not synced yet
+        self.pending = {}
+        self.running = set()
+
+    def push(self, branch, before, after):
+        with self.lock:
+            if branch in self.pending:
+                self.pending[branch][1] = after
+                log('{}: push {}..{} coalesced'.format(branch, before[:8], after[:8]))
+                return
+            self.pending[branch] = [before, after]
+            if branch not in self.running:
+                self.schedule(branch)
+
+    def schedule(self, branch):
+        timer = threading.Timer(self.delay, self.run, [branch])
+        timer.daemon = True
+        timer.start()
+
+    def run(self, branch):
+        with self.lock:
+            before, after = self.pending.pop(branch)
+            self.running.add(branch)
+        try:
+            log('{}: sync of {}..{}'.format(branch, before[:8], after[:8]))
+            self.start_sync(branch, before, after)
+        except Exception as error:  # The next push retries
+            log('{}: sync failed: {}'.format(branch, error))
+        finally:
+            with self.lock:
+                self.running.discard(branch)
+                if branch in self.pending:
+                    self.schedule(branch)
+
+
+def gitlab_starter(args):
+    """Trigger the CI pipeline, restricted to the sync definitions of the branch"""
+    endpoint = '{}/api/v4/projects/{}/trigger/pipeline'.format(args.url.rstrip('/'),
+                                                              urllib.parse.quote(args.project, safe=''))
+
+    def start_sync(branch, before, after):
+        data = urllib.parse.urlencode({
+            'token': args.token,
+            'ref': args.ref,
+            'variables[SYNC_IDF_BRANCHES]': branch,
+            'variables[INCREMENTAL]': '1',
+            'variables[IDF_PUSH_BEFORE]': before,
+            'variables[IDF_PUSH_AFTER]': after,
+        }).encode()
+        with urllib.request.urlopen(endpoint, data, timeout=60) as response:
+            log('{}: pipeline {}'.format(branch, json.load(response).get('web_url')))
+
+    return start_sync
+
+
+def local_starter(args, syncs):
+    """Run the sync script in the work directory, with the current environment"""
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    def start_sync(branch, before, after):
+        env = dict(os.environ, SYNC_ONLY=' '.join(syncs[branch]), INCREMENTAL='1', SKIP_UNCHANGED='1',
+                   IDF_PUSH_BEFORE=before, IDF_PUSH_AFTER=after)
+        log_file = os.path.join(args.work_dir, 'sync-{}.log'.format(branch.replace('/', '_')))
+        with open(log_file, 'w') as output:
+            status = subprocess.call([os.path.join(TOOLS_DIR, 'extract_idf_components.sh')],
+                                     cwd=args.work_dir, env=env, stdout=output, stderr=subprocess.STDOUT)
+        log('{}: sync exited with {}, see {}'.format(branch, status, log_file))
+
+    return start_sync
+
+
+def make_handler(args, syncs, coalescer):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def reply(self, code, message):
+            self.send_response(code)
+            self.send_header('Content-Type', 'text/plain')
+            self.end_headers()
+            self.wfile.write((message + '\n').encode())
+
+        def authorized(self, body):
+            if not args.secret:
+                return True
+            if 'X-Gitlab-Token' in self.headers:
+                return hmac.compare_digest(self.headers['X-Gitlab-Token'], args.secret)
+            signature = self.headers.get('X-Hub-Signature-256', '')
+            expected = 'sha256=' + hmac.new(args.secret.encode(), body, hashlib.sha256).hexdigest()
+            return hmac.compare_digest(signature, expected)
+
+        def do_POST(self):
+            body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+            if not self.authorized(body):
+                return self.reply(403, 'bad secret')
+            try:
+                event = json.loads(body)
+                ref, before, after = event['ref'], event['before'], event['after']
+            except (ValueError, KeyError):
+                return self.reply(400, 'not a push event')
+
+            branch = ref[len('refs/heads/'):] if ref.startswith('refs/heads/') else None
+            if branch not in syncs:
+                return self.reply(200, 'ignored, {} is not synced'.format(ref))
+            if after == NULL_SHA:
+                return self.reply(200, 'ignored, {} was deleted'.format(ref))
+
+            coalescer.push(branch, before, after)
+            return self.reply(202, 'sync of {} queued'.format(branch))
+
+        def log_message(self, format, *args):
+            log('{} {}'.format(self.address_string(), format % args))
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--listen', default='127.0.0.1:8080', help='address and port to listen to')
+    parser.add_argument('--secret', help='webhook secret token, required in gitlab mode')
+    parser.add_argument('--delay', type=float, default=60,
+                        help='seconds to wait for other pushes before starting a sync')
+    modes = parser.add_subparsers(dest='mode', required=True)
+
+    gitlab = modes.add_parser('gitlab', help='trigger the CI pipeline')
+    gitlab.add_argument('--url', required=True, help='GitLab server URL')
+    gitlab.add_argument('--project', required=True, help='ID or path of the esp-hal-3rdparty project')
+    gitlab.add_argument('--token', required=True, help='pipeline trigger token')
+    gitlab.add_argument('--ref', default='master', help='branch of the pipeline')
+
+    local = modes.add_parser('local', help='run the sync script locally')
+    local.add_argument('--work-dir', default='sync_trigger_work', help='where the sync script runs')
+
+    args = parser.parse_args()
+    if args.mode == 'gitlab' and not args.secret:
+        parser.error('--secret is required in gitlab mode, anyone reaching --listen could start pipelines')
+    syncs = manifest_syncs()
+    start_sync = gitlab_starter(args) if args.mode == 'gitlab' else local_starter(args, syncs)
+
+    host, port = args.listen.rsplit(':', 1)
+    server = http.server.ThreadingHTTPServer((host, int(port)),
+                                             make_handler(args, syncs, Coalescer(args.delay, start_sync)))
+    log('Listening on {} for pushes of {}'.format(args.listen, ', '.join(sorted(syncs))))
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()